@@ -0,0 +1,85 @@
+#!/bin/sh
+# Benchmark capmq across formats, thread counts and capping modes.
+#
+# Reports reads and megabytes (of input) per second for each run, and checks
+# that the reads written match those of a single threaded (-@0) run, which
+# always comes first. Times are the wall clock times capmq gives in its
+# --stats report, so no more than a POSIX shell and awk are needed.
+# Settings come from the environment; see the bench target in the Makefile.
+
+N=${BENCH_READS:-1000000}
+THREADS=${BENCH_THREADS:-"0 2 4 8"}
+FORMATS=${BENCH_FORMATS:-"sam bam cram"}
+DIR=${BENCH_DIR:-bench.tmp}
+
+MODES='-C30
+-C40 -g rg0:20 -g rg1:25
+-C40 -G DIR/rg.txt
+-r
+-C30 -S'
+
+# the thread counts to run, starting with the single threaded baseline
+RUNS=0
+for t in $THREADS; do
+    [ "$t" = 0 ] || RUNS="$RUNS $t"
+done
+
+# htslib format options for each format
+fmt_opts() {
+    case $1 in
+        cram) echo cram,no_ref ;;
+        *) echo $1 ;;
+    esac
+}
+
+mkdir -p $DIR || exit 1
+printf 'rg0\t20\nrg1\t25\nrg2\t30\n' > $DIR/rg.txt
+rm -f $DIR/failed
+
+for f in $FORMATS; do
+    fo=$(fmt_opts $f)
+    echo "Generating $N reads as $f" >&2
+    ./gen_sam -n $N -O $fo > $DIR/in.$f || exit 1
+    # input for restoring, with om tags
+    ./capmq -C30 -O $fo $DIR/in.$f $DIR/om.$f || exit 1
+done
+
+printf '%-6s %-26s %7s %8s %12s %9s  %s\n' format mode threads seconds reads/s MB/s output
+echo "$MODES" | while IFS= read -r mode; do
+    mode=$(echo "$mode" | sed "s|DIR|$DIR|")
+    for f in $FORMATS; do
+        fo=$(fmt_opts $f)
+        in=$DIR/in.$f
+        [ "$mode" = "-r" ] && in=$DIR/om.$f
+        size=$(wc -c < $in)
+        base=
+        for t in $RUNS; do
+            if ! ./capmq $mode -@$t --stats $DIR/stats.json -O $fo $in $DIR/out.$f; then
+                echo "FAILED: ./capmq $mode -@$t -O $fo $in" >&2
+                touch $DIR/failed
+                continue
+            fi
+            wall=$(sed -n 's/.*"wall": *\([0-9.]*\).*/\1/p' $DIR/stats.json)
+            sum=$(./gen_sam -c $DIR/out.$f)
+            if [ $t = 0 ]; then
+                base=$sum
+                check=baseline
+            elif [ -z "$base" ]; then
+                check="no baseline"
+            elif [ "$sum" = "$base" ]; then
+                check=same
+            else
+                check=DIFFERENT
+                touch $DIR/failed
+            fi
+            echo "$f|$mode|$t|$wall|$size|$check" | awk -F'|' -v n=$N '{
+                s = $4; if (s <= 0) s = 1e-6;
+                printf "%-6s %-26s %7d %8.2f %12.0f %9.1f  %s\n", $1, $2, $3, s, n / s, $5 / s / 1e6, $6 }'
+        done
+    done
+done
+
+if [ -e $DIR/failed ]; then
+    echo "Some runs failed or gave different output" >&2
+    exit 1
+fi
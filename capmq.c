@@ -28,121 +28,376 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <ctype.h>
 #include <math.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include <htslib/sam.h>
-#include <cram/sam_header.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/cram.h>
+#include <htslib/faidx.h>
+#include <htslib/khash.h>
+#include <htslib/thread_pool.h>
+#include <htslib/kstring.h>
 #include "version.h"
+#include "capmq.h"
 
-// Read Group / Capping Quality pair (for -g or -G options)
+// Per read group counts for --stats
 typedef struct {
-    char *rg;   // read group
-    uint8_t  capQ;  // map quality
-} rgv_t;
+    uint64_t reads, mapped, capped, restored;
+} rgcount_t;
 
-// Array of RG/Value pairs (for -g or -G options)
+KHASH_MAP_INIT_STR(rgstats, rgcount_t)
+
+enum { PHASE_DECODE, PHASE_PROCESS, PHASE_ENCODE, NPHASES };
+
+// Statistics for --stats; threads keep their own and they are merged
 typedef struct {
-    int end;    // number of entries
-    int max;    // maximum number of entries
-    rgv_t **rgv; // list of RG/Value pairs
-} rgva_t;
+    rgcount_t all;
+    uint64_t before[256];   // MAPQ histograms
+    uint64_t after[256];
+    khash_t(rgstats) *rg;
+    khint_t last;           // slot of the last read group counted
+    rgcount_t *ctg;         // counts by tid, for as many as have been seen
+    int nctg;
+    double time[NPHASES];   // seconds spent in each phase, summed over threads
+} capstats_t;
 
-// initialise the rgv array
-static rgva_t *rgva_init(int max)
+static capstats_t *stats_init(void)
 {
-    rgva_t *rgva = calloc(1, sizeof(rgva_t));
-    rgva->end = 0;
-    rgva->max = max;
-    rgva->rgv = calloc(max, sizeof(rgv_t *));
-    return rgva;
+    capstats_t *s = calloc(1, sizeof(capstats_t));
+    if (!s) return NULL;
+    if (!(s->rg = kh_init(rgstats))) {
+        free(s);
+        return NULL;
+    }
+    return s;
 }
 
-static int rgv_cmp(const void *p1, const void *p2)
+static void stats_destroy(capstats_t *s)
 {
-    rgv_t *rgv1 = *(rgv_t **)p1;
-    rgv_t *rgv2 = *(rgv_t **)p2;
-    return strcmp(rgv1->rg, rgv2->rg);
+    khint_t k;
+    if (!s) return;
+    for (k = kh_begin(s->rg); k != kh_end(s->rg); k++)
+        if (kh_exist(s->rg, k)) free((char *)kh_key(s->rg, k));
+    kh_destroy(rgstats, s->rg);
+    free(s->ctg);
+    free(s);
 }
 
-static int rgv_keycmp(const void *p1, const void *p2)
+/*
+ * Find the counts for a read group, adding it if necessary.
+ * Returns NULL if out of memory.
+ */
+static rgcount_t *stats_rg(capstats_t *s, const char *rg)
 {
-    char *key = (char *)p1;
-    rgv_t *rgv2 = *(rgv_t **)p2;
-    return strcmp(key, rgv2->rg);
+    khint_t k = s->last;
+    int ret;
+
+    // reads tend to come in runs from one group
+    if (k < kh_end(s->rg) && kh_exist(s->rg, k) && strcmp(kh_key(s->rg, k), rg) == 0)
+        return &kh_val(s->rg, k);
+
+    k = kh_get(rgstats, s->rg, rg);
+    if (k == kh_end(s->rg)) {
+        char *key = strdup(rg);
+        if (!key) return NULL;
+        k = kh_put(rgstats, s->rg, key, &ret);
+        if (ret < 0) {
+            free(key);
+            return NULL;
+        }
+        memset(&kh_val(s->rg, k), 0, sizeof(rgcount_t));
+    }
+    s->last = k;
+    return &kh_val(s->rg, k);
 }
 
-static void rgva_sort(rgva_t *rgva)
+/*
+ * Find the counts for a contig, growing the table if necessary.
+ * Returns NULL if out of memory.
+ */
+static rgcount_t *stats_ctg(capstats_t *s, int tid)
 {
-    qsort(rgva->rgv, rgva->end, sizeof(rgv_t*), rgv_cmp);
+    if (tid >= s->nctg) {
+        int n = tid + 1 > 2 * s->nctg ? tid + 1 : 2 * s->nctg;
+        rgcount_t *c = realloc(s->ctg, n * sizeof(rgcount_t));
+        if (!c) return NULL;
+        memset(c + s->nctg, 0, (n - s->nctg) * sizeof(rgcount_t));
+        s->ctg = c;
+        s->nctg = n;
+    }
+    return &s->ctg[tid];
 }
 
-static rgv_t *rgva_find(rgva_t *rgva, char *rg)
+/*
+ * Count one read. Reads without a read group or a contig are only
+ * counted overall and by whichever of the two they have.
+ */
+static void stats_count(capstats_t *s, const char *rg, int tid, uint16_t flag, uint8_t before, uint8_t after, bool restored)
 {
-    void *result = bsearch(rg, rgva->rgv, rgva->end, sizeof(rgv_t *), rgv_keycmp);
-    return result ? *(rgv_t **)result : NULL;
+    rgcount_t *c[3] = { &s->all, rg ? stats_rg(s, rg) : NULL, tid >= 0 ? stats_ctg(s, tid) : NULL };
+    int i;
+
+    s->before[before]++;
+    s->after[after]++;
+    for (i = 0; i < 3; i++) {
+        if (!c[i]) continue;
+        c[i]->reads++;
+        if (!(flag & BAM_FUNMAP)) c[i]->mapped++;
+        if (restored) c[i]->restored++;
+        else if (after < before) c[i]->capped++;
+    }
 }
 
+static void rgcount_add(rgcount_t *a, const rgcount_t *b)
+{
+    a->reads += b->reads;
+    a->mapped += b->mapped;
+    a->capped += b->capped;
+    a->restored += b->restored;
+}
 
-// push entry onto rgv array
-static void rgva_push(rgva_t *rgva, rgv_t *rgv)
+/*
+ * Add the statistics of src to dst and clear src
+ */
+static int stats_merge(capstats_t *dst, capstats_t *src)
 {
-    if (rgva->end == rgva->max) {
-        // expand the array
-        rgva->max *= 2;
-        rgva->rgv = realloc(rgva->rgv, rgva->max * sizeof(rgv_t *));
+    khint_t k;
+    int i;
+
+    rgcount_add(&dst->all, &src->all);
+    for (i = 0; i < 256; i++) {
+        dst->before[i] += src->before[i];
+        dst->after[i] += src->after[i];
     }
-    rgva->rgv[rgva->end] = rgv;
-    rgva->end++;
+    for (i = 0; i < NPHASES; i++) dst->time[i] += src->time[i];
+    for (k = kh_begin(src->rg); k != kh_end(src->rg); k++) {
+        rgcount_t *c;
+        if (!kh_exist(src->rg, k)) continue;
+        if (!(c = stats_rg(dst, kh_key(src->rg, k)))) return -1;
+        rgcount_add(c, &kh_val(src->rg, k));
+        memset(&kh_val(src->rg, k), 0, sizeof(rgcount_t));
+    }
+    for (i = 0; i < src->nctg; i++) {
+        rgcount_t *c;
+        if (!src->ctg[i].reads) continue;
+        if (!(c = stats_ctg(dst, i))) return -1;
+        rgcount_add(c, &src->ctg[i]);
+        memset(&src->ctg[i], 0, sizeof(rgcount_t));
+    }
+    memset(&src->all, 0, sizeof(src->all));
+    memset(src->before, 0, sizeof(src->before));
+    memset(src->after, 0, sizeof(src->after));
+    memset(src->time, 0, sizeof(src->time));
+    return 0;
 }
 
-// Global options
+// Seconds on a monotonic clock
+static inline double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Charge the time since t to a phase, returning the time now
+ */
+static inline double stats_phase(capstats_t *s, int phase, double t)
+{
+    double now = stats_now();
+    s->time[phase] += now - t;
+    return now;
+}
+
+// The empty block that ends a BGZF file
+static const uint8_t bgzf_eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
+// An output file, given with -o or as the second argument
+typedef struct {
+    char *fn;
+    char mode[5];
+    htsFormat fmt;      // shares its format options with opts->out_fmt
+    samFile *fp;
+    char *fnidx;        // index to build while writing (--write-index)
+    int index_min_shift;    // 0 for BAI, 14 for CSI
+} output_t;
+
+KHASH_MAP_INIT_STR(rgsplit, int)
+
+// A read group's own output file (--split-rg)
+typedef struct {
+    char *rg;
+    output_t out;       // out.fp is NULL while the file is closed
+    bam_hdr_t *header;  // with only this read group's @RG line
+    bool created;       // reopen to append once the header is written
+    uint64_t used;      // when last written, to close the least recently used
+} split_t;
+
+// The read group output files, at most max_open of them open at once
+typedef struct {
+    split_t *s;
+    int n;
+    khash_t(rgsplit) *idx;  // read group ID to s[]
+    int last;           // index of the last read group written, or -1
+    int nopen, max_open;
+    uint64_t clock;
+} splitter_t;
+
+// One line of a --manifest file
+typedef struct {
+    char *fnin, *fnout;
+    capmq_rules_t *rules;   // the command line rules and any from the job's own file
+} job_t;
+
+// How far a run had got at its last checkpoint (--checkpoint)
+typedef struct {
+    int64_t in_voff;    // input virtual offset of the next read
+    int64_t out_size;   // output length, at a BGZF block boundary
+    uint64_t reads;     // reads written by then
+} checkpoint_t;
+
+// Live counts for --progress. Each thread counts in its own copy and adds
+// that to the shared one every PROGRESS_BATCH reads, so nothing locks.
 typedef struct {
+    uint64_t reads, written, capped, restored;
+    uint64_t bytes;     // of the reads as uncompressed BAM
+    int32_t tid;        // position of the last read counted
+    int64_t pos;
+} progress_t;
+
+#define PROGRESS_BATCH 4096
+
+// Global options
+typedef struct opts_t opts_t;
+struct opts_t {
     bool verbose;
-    uint8_t capQ;
-    bool storeQ;
-    bool restoreQ;
     bool freemix;
     uint8_t minQ;
+    capmq_rules_t *rules;
+    int nthreads;       // size of the pool shared by input and output (-@)
+    int in_threads;     // dedicated input threads (--input-threads)
+    int out_threads;    // dedicated output threads (--output-threads)
+    htsThreadPool pool;
+    bool pipeline;      // batched reader/worker/writer processing (--pipeline)
+    int batch_size;     // reads per pipeline batch (--batch-size)
+    bool sam_text_in;   // the pipeline workers parse the uncompressed SAM input
+    bool sam_text_out;  // and format the uncompressed SAM outputs
+    bool passthrough;   // copy unchanged BGZF blocks verbatim (--block-passthrough)
+    bool raw;           // patch BAM records without unpacking them (unless --no-raw)
+    bool no_raw;
+    bool by_region;     // cap regions of an indexed input in parallel (--by-region)
+    int region_size;    // bases per region, or 0 to choose (--region-size)
+    char *tmp_prefix;   // prefix of the per-region temporary files (--tmp-prefix)
+    bool write_index;   // index the output files as they are written (--write-index)
+    bool scan;          // count what would be capped and write no reads (--scan)
+    bool cram_no_md;    // CRAM to CRAM, so MD and NM need not be rebuilt on input
+    char *ref_cache;    // shared reference cache directory (--ref-cache)
+    char *ref_seqs;     // FASTA file to fill the cache from (--ref-seqs)
+    int index_min_shift;    // 0 for BAI, 14 for CSI
+    char *stats_fn;     // JSON report to write (--stats)
+    char *split_fmt;    // per read group file names, %r for the ID (--split-rg)
+    int split_max_open; // most read group files to keep open (--split-max-open)
+    splitter_t *split;
+    capstats_t *stats;
+    char *fnin;
+    htsFormat in_fmt;
+    htsFormat out_fmt;
     samFile *in;
-    samFile *out;
+    output_t *out;      // every read is written to each of these
+    int nout;
     char *argv_list;
-    rgva_t *rgva;
-} opts_t;
+    char *manifest;     // file listing the jobs to run (--manifest)
+    job_t *job;
+    int njob;
+    int max_jobs;       // most jobs to run at once (--jobs)
+    char *checkpoint_fn;    // file to record progress in (--checkpoint)
+    int checkpoint_reads;   // reads between checkpoints (--checkpoint-reads)
+    bool resume;        // carry on from the checkpoint, if there is one (--resume)
+    bool resuming;      // there was one, and the output is open to append
+    checkpoint_t ckpt;
+    char *progress_fn;  // live counts, rewritten every so often (--progress)
+    int progress_interval;  // seconds between reports (--progress-interval)
+    progress_t *progress;   // the shared counts, if there is a --progress
+};
 
-static void free_opts(opts_t *opts)
+/*
+ * Close the read group files, returning -1 if any of them failed
+ */
+static int split_destroy(splitter_t *sp)
 {
-    int n;
-    if (!opts) return;
-    if (opts->in) sam_close(opts->in);
-    if (opts->out) sam_close(opts->out);
-    free(opts->argv_list);
-    if (opts->rgva) {
-        for (n=0; n < opts->rgva->end; n++) {
-            rgv_t *rgv = opts->rgva->rgv[n];
-            free(rgv->rg);
-            free(rgv);
+    int i, ret = 0;
+
+    if (!sp) return 0;
+    for (i = 0; i < sp->n; i++) {
+        split_t *s = &sp->s[i];
+        if (s->out.fp && sam_close(s->out.fp) < 0) {
+            fprintf(stderr, "Failed to close %s\n", s->out.fn);
+            ret = -1;
         }
+        if (s->header) bam_hdr_destroy(s->header);
+        free(s->out.fn);
+        free(s->rg);
     }
+    kh_destroy(rgsplit, sp->idx);
+    free(sp->s);
+    free(sp);
+    return ret;
 }
 
-// Convert freemix value to quality value, or die trying
-static inline uint8_t f2q(double f)
+/*
+ * Close the input and output files, returning -1 if any output failed
+ */
+static int close_files(opts_t *opts)
 {
-    double qd;
-    if (f == 0) {
-      return 0;
-    } else if (f < 0) {
-      fprintf(stderr, "cannot interpret negative freemix value %f\n", f);
-    }
-    qd = -10.0 * log10(f);
-    if (qd < 0.0) {
-      return 0;
+    int i, ret = 0;
+    if (opts->in) sam_close(opts->in);
+    opts->in = NULL;
+    for (i = 0; i < opts->nout; i++) {
+        if (opts->out[i].fp && sam_close(opts->out[i].fp) < 0) {
+            fprintf(stderr, "Failed to close %s\n", opts->out[i].fn);
+            ret = -1;
+        }
+        free(opts->out[i].fnidx);
     }
-    if (qd > 255.0) {
-      return 255;
+    free(opts->out);
+    opts->out = NULL;
+    opts->nout = 0;
+    return ret;
+}
+
+static void free_opts(opts_t *opts)
+{
+    int i;
+    if (!opts) return;
+    close_files(opts);
+    split_destroy(opts->split);
+    // the pool must outlive the files using it
+    if (opts->pool.pool) hts_tpool_destroy(opts->pool.pool);
+    hts_opt_free(opts->in_fmt.specific);
+    hts_opt_free(opts->out_fmt.specific);
+    free(opts->argv_list);
+    stats_destroy(opts->stats);
+    capmq_rules_destroy(opts->rules);
+    for (i = 0; i < opts->njob; i++) {
+        free(opts->job[i].fnin);
+        free(opts->job[i].fnout);
+        capmq_rules_destroy(opts->job[i].rules);
     }
-    return (uint8_t) qd;
+    free(opts->job);
+    free(opts->progress);
 }
 
 /*
@@ -169,6 +424,22 @@ static uint8_t uint8_from_str(char *str)
     return retval;
 }
 
+/*
+ * Get non-negative int from string, or die trying
+ */
+static int int_from_str(char *str)
+{
+    long int val;
+    char *end;
+    errno = 0;
+    val = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end || val < 0 || val > INT_MAX) {
+        fprintf(stderr, "ERROR: failed to parse `%s' as a non-negative integer\n", str);
+        exit(1);
+    }
+    return (int)val;
+}
+
 /*
  * Get valid capq from string, or die trying
  */
@@ -192,7 +463,7 @@ static uint8_t capq_from_str(char *str, bool freemix)
           perror("strtod");
           exit(1);
       } else {
-          capQ = f2q(val);
+          capQ = capmq_freemix2q(val);
       }
     } else {
       capQ = uint8_from_str(str);
@@ -204,59 +475,121 @@ static uint8_t capq_from_str(char *str, bool freemix)
  * Parse an RG:val pair
  * Format is RG:val
  *
- * where RG  is the Read Group
+ * where RG  is the Read Group (or contig, for -t)
  *       val is the capQ value (or freemix value)
  */
-static void parse_rgv(rgva_t *rgva, char *arg, bool freemix)
+static void parse_rgv(capmq_rules_t *rules, int (*set_cap)(capmq_rules_t *, const char *, uint8_t),
+                      char *arg, bool freemix)
 {
     char *argstr = strdup(arg);
     char *s = strrchr(argstr,':');
     if (s) {
-        rgv_t *rgv = calloc(1, sizeof(rgv_t));
         *s=0;
-        rgv->rg = strdup(argstr);
-        rgv->capQ = capq_from_str(s+1, freemix);
-        rgva_push(rgva,rgv);
+        if (set_cap(rules, argstr, capq_from_str(s+1, freemix)) < 0) {
+            fprintf(stderr, "ERROR: failed to store cap for %s\n", argstr);
+            exit(1);
+        }
     }
     free(argstr);
 }
 
 /*
- * Parse RG, val pairs from a tab delimited file
+ * Parse RG (or contig), val pairs from a tab delimited file.
+ * Lines are split in place in a single reused buffer.
  */
-static void parse_gfile(char *fname, opts_t *opts)
+static void parse_gfile(char *fname, capmq_rules_t *rules, int (*set_cap)(capmq_rules_t *, const char *, uint8_t),
+                        bool freemix)
 {
     char *buf = NULL;
-    size_t n;
+    size_t n = 0;
+    ssize_t len;
     FILE *fh = fopen(fname,"r");
     if (!fh) {
         fprintf(stderr,"ERROR: Can't open file %s: %s\n", fname, strerror(errno));
         exit(1);
     }
 
-    while (getline(&buf, &n, fh) > 0) {
-        if (buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1]=0;   // remove trailing lf
+    while ((len = getline(&buf, &n, fh)) > 0) {
+        if (buf[len-1] == '\n') buf[--len]=0;    // remove trailing lf
         if (*buf && *buf!='#') {    // ignore blank lines and comments
             char *s = strchr(buf,'\t');
             if (s) {
-                *s=':'; parse_rgv(opts->rgva, buf, opts->freemix);
+                *s=0;
+                if (set_cap(rules, buf, capq_from_str(s+1, freemix)) < 0) {
+                    fprintf(stderr, "ERROR: failed to store cap for %s\n", buf);
+                    exit(1);
+                }
             }
         }
-        free(buf); buf=NULL;
     }
+    free(buf);
+    fclose(fh);
+}
+
+/*
+ * Read region caps from a BED file: chromosome, start, end and the cap
+ * (or freemix value with -f) in the fourth column. Dies on a bad line.
+ */
+static void parse_bedfile(char *fname, opts_t *opts)
+{
+    char *buf = NULL;
+    size_t n = 0;
+    ssize_t len;
+    int line = 0;
+    FILE *fh = fopen(fname,"r");
+    if (!fh) {
+        fprintf(stderr,"ERROR: Can't open file %s: %s\n", fname, strerror(errno));
+        exit(1);
+    }
+
+    while ((len = getline(&buf, &n, fh)) > 0) {
+        char *col[4] = {NULL}, *end;
+        int64_t beg, stop;
+        int i;
+
+        line++;
+        if (buf[len-1] == '\n') buf[--len]=0;    // remove trailing lf
+        if (len && buf[len-1] == '\r') buf[--len]=0;
+        // ignore blank lines, comments and browser and track lines
+        if (!*buf || *buf == '#' || strncmp(buf, "track", 5) == 0 || strncmp(buf, "browser", 7) == 0) continue;
+
+        col[0] = buf;
+        for (i = 1; i < 4 && col[i-1]; i++) {
+            if ((col[i] = strchr(col[i-1], '\t'))) *col[i]++ = 0;
+        }
+        if (!col[3]) {
+            fprintf(stderr, "ERROR: %s line %d needs chromosome, start, end and cap columns\n", fname, line);
+            exit(1);
+        }
+        errno = 0;
+        beg = strtoll(col[1], &end, 10);
+        if (errno || end == col[1] || *end || beg < 0) {
+            fprintf(stderr, "ERROR: bad start `%s' on %s line %d\n", col[1], fname, line);
+            exit(1);
+        }
+        errno = 0;
+        stop = strtoll(col[2], &end, 10);
+        if (errno || end == col[2] || *end || stop < beg) {
+            fprintf(stderr, "ERROR: bad end `%s' on %s line %d\n", col[2], fname, line);
+            exit(1);
+        }
+        if (capmq_add_region_cap(opts->rules, col[0], beg, stop, capq_from_str(col[3], opts->freemix)) < 0) {
+            perror("cannot allocate region caps");
+            exit(1);
+        }
+    }
+    free(buf);
     fclose(fh);
 }
 
 /*
- * convert SAM_hdr to bam_hdr
+ * Give a file its own pool of n threads, or else attach it to the shared pool
  */
-static void sam_hdr_unparse2(SAM_hdr *sh, bam_hdr_t *h)
+static int attach_threads(samFile *fp, int n, const htsThreadPool *pool)
 {
-    free(h->text);
-    sam_hdr_rebuild(sh);
-    h->text = strdup(sam_hdr_str(sh));
-    h->l_text = sam_hdr_length(sh);
-    sam_hdr_free(sh);
+    if (n > 0) return hts_set_threads(fp, n);
+    if (pool->pool) return hts_set_opt(fp, HTS_OPT_THREAD_POOL, pool);
+    return 0;
 }
 
 /*
@@ -268,73 +601,481 @@ static void usage(FILE *fp) {
     fprintf(fp, "Version: %s (using htslib %s)\n", CAPMQ_VERSION, hts_version());
     fprintf(fp, "About:   cap mapping quality (MAPQ) to the specified value\n");
     fprintf(fp, "Usage:   capmq [options] in-file out-file\n");
+    fprintf(fp, "         capmq [options] --manifest FILE\n");
     fprintf(fp, "Options:\n");
     fprintf(fp, "  -C max              Cap MAPQ at max (default: 255)\n");
-    fprintf(fp, "  -S                  Do not store original MAPQ in om:i aux tag\n");
-    fprintf(fp, "  -r                  Restore original MAPQ from om:i aux tag\n");
+    fprintf(fp, "  -S                  Do not store original MAPQ in om:i aux tag (or MQ in mq:i)\n");
+    fprintf(fp, "  -r                  Restore original MAPQ from om:i aux tag (and MQ from mq:i)\n");
     fprintf(fp, "  -v                  verbose\n");
+    fprintf(fp, "  --cap-mq            Also cap the MQ:i tag (the mate's MAPQ) at the cap of the\n");
+    fprintf(fp, "                      mate, from the read group and the mate's position, so\n");
+    fprintf(fp, "                      it matches the mate's new MAPQ without a fixmate pass.\n");
+    fprintf(fp, "                      The old MQ is kept in mq:i unless -S is given.\n");
     fprintf(fp, "  -g RG:max           Cap MAPQ for read group IDs.\n");
     fprintf(fp, "                      This can be specified more than once, and if specified\n");
     fprintf(fp, "                      will overide the -C paramater for those read groups.\n");
     fprintf(fp, "  -G filename         As for -g, but group ID/max value pairs are read from\n");
     fprintf(fp, "                      a tab delimited file.\n");
-    fprintf(fp, "  -f                  The values to -C, -g or in the file specified with -G\n");
-    fprintf(fp, "                      are NOT maximum MAPQ scores, but estimated fraction of\n");
-    fprintf(fp, "                      contamination (e) from which to calculate the maximum\n");
-    fprintf(fp, "                      MAPQ as int(10*log10(1/e)).\n");
+    fprintf(fp, "  -t contig:max       Cap MAPQ for reads placed on a contig. This can be\n");
+    fprintf(fp, "                      specified more than once.\n");
+    fprintf(fp, "  -T filename         As for -t, but contig/max value pairs are read from\n");
+    fprintf(fp, "                      a tab delimited file.\n");
+    fprintf(fp, "  -R filename         Cap MAPQ for reads starting in the intervals of a BED\n");
+    fprintf(fp, "                      file, with the cap in the fourth column. Where\n");
+    fprintf(fp, "                      intervals overlap the lowest cap applies.\n");
+    fprintf(fp, "  -f                  The values to -C, -g, -t or in the files specified with\n");
+    fprintf(fp, "                      -G, -T or -R are NOT maximum MAPQ scores, but estimated\n");
+    fprintf(fp, "                      fraction of contamination (e) from which to calculate\n");
+    fprintf(fp, "                      the maximum MAPQ as int(10*log10(1/e)).\n");
     fprintf(fp, "  -m min              Minimum MAPQ. Do not set the calculated quality\n");
     fprintf(fp, "                      to less than this value. Only used with -f\n");
     fprintf(fp, "                      (default: 0)\n");
     fprintf(fp, "  -I fmt(,opt...)     Input format and format-options [auto].\n");
     fprintf(fp, "  -O fmt(,opt...)     Output format and format-options [SAM].\n");
+    fprintf(fp, "  -o FILE             Write the reads to FILE, as well as to out-file if it is\n");
+    fprintf(fp, "                      given, in the format the name gives (.sam, .bam, .cram)\n");
+    fprintf(fp, "                      or else as for -O. This can be specified more than\n");
+    fprintf(fp, "                      once; each read is decoded and capped once for all.\n");
+    fprintf(fp, "  -@, --threads N     Number of threads in a pool shared by input and output\n");
+    fprintf(fp, "                      for decompression and compression (default: 0)\n");
+    fprintf(fp, "  --input-threads N   Use a dedicated pool of N threads for the input file\n");
+    fprintf(fp, "                      instead of the shared pool\n");
+    fprintf(fp, "  --output-threads N  Use a dedicated pool of N threads for each output file\n");
+    fprintf(fp, "                      instead of the shared pool\n");
+    fprintf(fp, "  --pipeline          Read, cap and write reads in batches on separate threads,\n");
+    fprintf(fp, "                      capping on the -@ pool (which defaults to 1 thread).\n");
+    fprintf(fp, "                      Uncompressed SAM is also parsed and formatted there.\n");
+    fprintf(fp, "  --batch-size N      Number of reads per pipeline batch (default: 1000)\n");
+    fprintf(fp, "  --block-passthrough BAM input and output only. Copy compressed blocks in which\n");
+    fprintf(fp, "                      no read changes straight to the output, and recompress\n");
+    fprintf(fp, "                      only the rest. Input threads are not used in this mode.\n");
+    fprintf(fp, "  --no-raw            For BAM input and output, decode every read in full\n");
+    fprintf(fp, "                      instead of patching the raw records in place\n");
+    fprintf(fp, "  --by-region         Coordinate sorted, indexed BAM or CRAM input only. Cap\n");
+    fprintf(fp, "                      regions of the genome in parallel on the -@ pool and\n");
+    fprintf(fp, "                      join them in order, with the unplaced reads last\n");
+    fprintf(fp, "  --region-size N     Bases per region for --by-region (default: a few\n");
+    fprintf(fp, "                      regions per thread, at least 1000000)\n");
+    fprintf(fp, "  --tmp-prefix PREFIX Prefix of the --by-region temporary files\n");
+    fprintf(fp, "                      (default: the output file name, or capmq)\n");
+    fprintf(fp, "  --write-index[=FMT] Index the output files as they are written, as a BAI\n");
+    fprintf(fp, "                      (the default) or CSI, or a CRAI for CRAM output\n");
+    fprintf(fp, "  --stats FILE        Write read counts (overall and per read group), MAPQ\n");
+    fprintf(fp, "                      histograms and timings to FILE as JSON\n");
+    fprintf(fp, "  --split-rg NAME     Write the reads of each @RG line to a file of its own,\n");
+    fprintf(fp, "                      named NAME with %%r replaced by the read group ID, and\n");
+    fprintf(fp, "                      with only that @RG line in the header. Other reads go\n");
+    fprintf(fp, "                      to the usual output.\n");
+    fprintf(fp, "  --split-max-open N  Keep at most N read group files open, closing the least\n");
+    fprintf(fp, "                      recently used and appending to it later (default: half\n");
+    fprintf(fp, "                      the open file limit). Not possible for CRAM.\n");
+    fprintf(fp, "  --manifest FILE     Run each job listed in FILE, one per line: the input\n");
+    fprintf(fp, "                      file, the output file and, optionally, a file of read\n");
+    fprintf(fp, "                      group caps as for -G, tab separated. The other options\n");
+    fprintf(fp, "                      apply to every job. The input, output, status and time\n");
+    fprintf(fp, "                      of each job is printed as it finishes, and a failed\n");
+    fprintf(fp, "                      job does not stop the rest.\n");
+    fprintf(fp, "  --jobs N            Number of manifest jobs to run at once, sharing the\n");
+    fprintf(fp, "                      -@ pool (default: 1)\n");
+    fprintf(fp, "  --checkpoint FILE   BAM input and output files only. Every so many reads,\n");
+    fprintf(fp, "                      flush the output and record in FILE how far the input\n");
+    fprintf(fp, "                      and output have got. FILE is removed when the run ends\n");
+    fprintf(fp, "                      successfully.\n");
+    fprintf(fp, "  --checkpoint-reads N\n");
+    fprintf(fp, "                      Number of reads between checkpoints (default: 10000000)\n");
+    fprintf(fp, "  --resume            Cut the output back to the --checkpoint file left by a\n");
+    fprintf(fp, "                      run that did not finish and carry on from there, or\n");
+    fprintf(fp, "                      start from the beginning if there is no checkpoint\n");
+    fprintf(fp, "  --ref-cache DIR     Look for CRAM reference sequences in DIR, laid out as\n");
+    fprintf(fp, "                      REF_CACHE=DIR/%%2s/%%2s/%%s, before REF_PATH. The files\n");
+    fprintf(fp, "                      are memory-mapped, so concurrent jobs share them.\n");
+    fprintf(fp, "  --ref-seqs FASTA    Add any @SQ sequences with an M5 tag that the\n");
+    fprintf(fp, "                      --ref-cache is missing, from an indexed FASTA file\n");
+    fprintf(fp, "  --progress FILE     Rewrite FILE (or - for standard error) with a line of\n");
+    fprintf(fp, "                      JSON counting the reads so far, where they have got to\n");
+    fprintf(fp, "                      and the rate, every so often and on SIGUSR1\n");
+    fprintf(fp, "  --progress-interval N\n");
+    fprintf(fp, "                      Seconds between --progress reports (default: 10)\n");
+    fprintf(fp, "  --scan, --dry-run   Write no reads, only the --stats report (to standard\n");
+    fprintf(fp, "                      output by default) with counts per read group and per\n");
+    fprintf(fp, "                      contig. CRAM input decodes only the fields needed.\n");
     fprintf(fp, "\n");
     fprintf(fp,
+"A read is capped at the lowest of its contig cap (-t), its region cap (-R)\n\
+and its read group cap (-g) or, if it has none, the default cap (-C).\n\
+\n");
+    fprintf(fp,
 "Standard htslib format options apply. So to create a CRAM file with lossy\n\
 template names enabled and a larger number of sequences per slice, try:\n\
 \n\
     capmq -O cram,lossy_names,seqs_per_slice=100000\n\
+\n\
+CRAM written out as CRAM is still decoded and encoded again in full; only\n\
+generating MD and NM from the reference is skipped, so the output keeps the\n\
+MD and NM tags that the input stores and gains no others.\n\
 \n");
 }
 
+/*
+ * Read the checkpoint left by an earlier run. Returns 1 if there is one,
+ * 0 if there is none, so that the run starts from the beginning, and -1
+ * if it cannot be read.
+ */
+static int read_checkpoint(opts_t *opts)
+{
+    checkpoint_t *c = &opts->ckpt;
+    FILE *fp = fopen(opts->checkpoint_fn, "r");
+    int n;
+
+    if (!fp) {
+        if (errno == ENOENT) return 0;
+        perror(opts->checkpoint_fn);
+        return -1;
+    }
+    n = fscanf(fp, "capmq checkpoint\t%"SCNd64"\t%"SCNd64"\t%"SCNu64, &c->in_voff, &c->out_size, &c->reads);
+    fclose(fp);
+    if (n != 3 || c->in_voff < 0 || c->out_size < 0) {
+        fprintf(stderr, "ERROR: %s is not a capmq checkpoint\n", opts->checkpoint_fn);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Open the input and outputs for a run, and choose the engine for them.
+ * fnarg is the output named on the command line, if any, and fnout[]
+ * those given with -o. Returns 0 on success, -1 on failure.
+ */
+static int open_files(opts_t *opts, char *fnin, char *fnarg, char **fnout, int nfnout)
+{
+    int i, nstdout = 0;
+
+    opts->fnin = fnin;
+    if (!(opts->in = sam_open_format(opts->fnin, "r", &opts->in_fmt))) {
+        perror(opts->fnin);
+        return -1;
+    }
+    // CRAM need only decode the fields the caps and counts look at; capping
+    // MQ also needs the mate's position to find the mate's cap
+    if (opts->scan && hts_get_format(opts->in)->format == cram
+        && (hts_set_opt(opts->in, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_AUX
+                        | (capmq_get_cap_mq(opts->rules) ? SAM_RNEXT | SAM_PNEXT : 0)) != 0
+            || hts_set_opt(opts->in, CRAM_OPT_DECODE_MD, 0) != 0)) {
+        fprintf(stderr, "Failed to set CRAM decoding options\n");
+        return -1;
+    }
+
+    if (!(opts->out = calloc(nfnout+1, sizeof(output_t)))) {
+        perror("cannot allocate option parsing memory");
+        return -1;
+    }
+    if (!opts->scan && (fnarg || !nfnout)) opts->out[opts->nout++].fn = fnarg ? fnarg : "-";
+    for (i = 0; i < nfnout; i++) opts->out[opts->nout++].fn = fnout[i];
+
+    if (opts->resume) {
+        int found = read_checkpoint(opts);
+        if (found < 0) return -1;
+        opts->resuming = found;
+    }
+
+    for (i = 0; i < opts->nout; i++) {
+        output_t *o = &opts->out[i];
+        // a resumed output is cut back to the checkpoint once it is known to be BAM
+        strcpy(o->mode, opts->resuming ? "a" : "w");
+        o->fmt = opts->out_fmt;
+        // -o files are written in the format their names give, if they give one,
+        // and otherwise as for -O
+        if (sam_open_mode(o->mode+1, o->fn, NULL) == 0 && o->fn != fnarg) o->fmt.format = unknown_format;
+        if (strcmp(o->fn, "-") == 0 && ++nstdout > 1) {
+            fprintf(stderr, "ERROR: only one output can go to standard output\n");
+            return -1;
+        }
+        if (!(o->fp = sam_open_format(o->fn, o->mode, &o->fmt))) {
+            perror(strcmp(o->fn, "-") != 0 ? o->fn : "(stdout)");
+            return -1;
+        }
+    }
+    // Going from CRAM to CRAM, only the MAPQ (and om) of a read changes, but
+    // every read is still decoded and encoded again. By default the decoder
+    // generates MD and NM from the reference for each read, which costs a
+    // walk along the reference. Skip that: MD and NM that the input stores
+    // are still decoded and written out, and none are generated and added.
+    opts->cram_no_md = hts_get_format(opts->in)->format == cram && opts->nout && !opts->split_fmt;
+    for (i = 0; i < opts->nout; i++)
+        if (hts_get_format(opts->out[i].fp)->format != cram) opts->cram_no_md = false;
+    if (opts->cram_no_md && hts_set_opt(opts->in, CRAM_OPT_DECODE_MD, 0) != 0) {
+        fprintf(stderr, "Failed to set CRAM decoding options\n");
+        return -1;
+    }
+    if (!opts->tmp_prefix) opts->tmp_prefix = opts->nout && strcmp(opts->out[0].fn, "-") != 0 ? opts->out[0].fn : "capmq";
+
+    if (opts->by_region) {
+        enum htsExactFormat fmt = hts_get_format(opts->in)->format;
+        if ((fmt != bam && fmt != cram) || strcmp(opts->fnin, "-") == 0) {
+            fprintf(stderr, "ERROR: --by-region needs an indexed BAM or CRAM input file\n");
+            return -1;
+        }
+        if (opts->nout > 1) {
+            fprintf(stderr, "ERROR: --by-region writes a single output file\n");
+            return -1;
+        }
+    }
+
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    for (i = 0; i < opts->nout && opts->write_index; i++) {
+        output_t *o = &opts->out[i];
+        const htsFormat *fmt = hts_get_format(o->fp);
+        kstring_t fnidx = {0, 0, NULL};
+        if (strcmp(o->fn, "-") == 0 || (fmt->format != cram && !o->fp->is_bgzf)) {
+            fprintf(stderr, "ERROR: --write-index needs BAM, CRAM or compressed SAM output files\n");
+            return -1;
+        }
+        // BAI only covers BAM, compressed SAM gets a CSI
+        o->index_min_shift = fmt->format == sam ? 14 : opts->index_min_shift;
+        ksprintf(&fnidx, "%s.%s", o->fn,
+                 fmt->format == cram ? "crai" : o->index_min_shift ? "csi" : "bai");
+        o->fnidx = fnidx.s;
+    }
+#endif
+
+    if (opts->checkpoint_fn) {
+        const output_t *o = &opts->out[0];
+        struct stat st;
+        if (hts_get_format(opts->in)->format != bam || strcmp(opts->fnin, "-") == 0
+            || strcmp(o->fn, "-") == 0 || hts_get_format(o->fp)->format != bam) {
+            fprintf(stderr, "ERROR: --checkpoint needs a BAM input file and a BAM output file\n");
+            return -1;
+        }
+        if (opts->resuming) {
+            if (stat(o->fn, &st) < 0 || st.st_size < opts->ckpt.out_size) {
+                fprintf(stderr, "ERROR: %s is shorter than at the checkpoint in %s\n", o->fn, opts->checkpoint_fn);
+                return -1;
+            }
+            // the output was opened to append, so carries on from here
+            if (truncate(o->fn, opts->ckpt.out_size) < 0) {
+                perror(o->fn);
+                return -1;
+            }
+        } else if (unlink(opts->checkpoint_fn) < 0 && errno != ENOENT) {
+            // a checkpoint from an earlier run would not match this output
+            perror(opts->checkpoint_fn);
+            return -1;
+        }
+    }
+
+    // the pipeline, block passthrough and region engines take precedence,
+    // and the index is built by sam_write1(). A BAM scan walks the raw
+    // records without copying them into bam1_t. Checkpoints are taken
+    // between reads, so need the reads one at a time.
+    opts->raw = !opts->no_raw && !opts->pipeline && !opts->passthrough && !opts->by_region && !opts->write_index
+                && !opts->split_fmt && !opts->checkpoint_fn && hts_get_format(opts->in)->format == bam
+                && (opts->scan || (opts->nout == 1 && hts_get_format(opts->out[0].fp)->format == bam));
+
+    if (opts->passthrough && (hts_get_format(opts->in)->format != bam || opts->nout > 1
+                              || hts_get_format(opts->out[0].fp)->format != bam)) {
+        fprintf(stderr, "ERROR: --block-passthrough needs BAM input and a single BAM output\n");
+        return -1;
+    }
+
+    // plain SAM text is split into lines by the pipeline reader and parsed
+    // and formatted on its workers, which htslib's own SAM threads would
+    // only get in the way of
+    opts->sam_text_in = opts->pipeline && hts_get_format(opts->in)->format == sam
+                        && hts_get_format(opts->in)->compression == no_compression;
+    opts->sam_text_out = opts->pipeline && opts->nout && !opts->split_fmt && !opts->write_index;
+    for (i = 0; i < opts->nout; i++)
+        if (hts_get_format(opts->out[i].fp)->format != sam
+            || hts_get_format(opts->out[i].fp)->compression != no_compression) opts->sam_text_out = false;
+
+    // block passthrough reads the raw input blocks itself, and the regions
+    // do their own decompression and compression
+    if (!opts->passthrough && !opts->by_region && !opts->sam_text_in
+        && attach_threads(opts->in, opts->in_threads, &opts->pool) < 0) {
+        fprintf(stderr, "Failed to set up threads\n");
+        return -1;
+    }
+    // the outputs all compress on the shared pool, unless given their own
+    for (i = 0; i < opts->nout && !opts->by_region && !opts->sam_text_out; i++) {
+        if (attach_threads(opts->out[i].fp, opts->out_threads, &opts->pool) < 0) {
+            fprintf(stderr, "Failed to set up threads\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the jobs from a --manifest file: input, output and optionally a
+ * file of read group caps as for -G, tab separated. Each job gets its
+ * own copy of the command line rules. Dies on a bad line, so that a
+ * mistake is found before any of the jobs has run.
+ */
+static void read_manifest(opts_t *opts)
+{
+    char *buf = NULL;
+    size_t n = 0;
+    ssize_t len;
+    int m = 0, line = 0;
+    FILE *fh = fopen(opts->manifest,"r");
+    if (!fh) {
+        fprintf(stderr,"ERROR: Can't open file %s: %s\n", opts->manifest, strerror(errno));
+        exit(1);
+    }
+
+    while ((len = getline(&buf, &n, fh)) > 0) {
+        char *col[3] = {NULL};
+        job_t *j;
+        int i;
+
+        line++;
+        if (buf[len-1] == '\n') buf[--len]=0;    // remove trailing lf
+        if (!*buf || *buf == '#') continue;     // ignore blank lines and comments
+
+        col[0] = buf;
+        for (i = 1; i < 3 && col[i-1]; i++) {
+            if ((col[i] = strchr(col[i-1], '\t'))) *col[i]++ = 0;
+        }
+        if (!col[1] || !*col[0] || !*col[1] || strcmp(col[1], "-") == 0) {
+            fprintf(stderr, "ERROR: %s line %d needs input and output file columns\n", opts->manifest, line);
+            exit(1);
+        }
+        if (opts->njob == m) {
+            job_t *tmp = realloc(opts->job, (m = m ? 2*m : 64) * sizeof(job_t));
+            if (!tmp) {
+                perror("cannot allocate manifest jobs");
+                exit(1);
+            }
+            opts->job = tmp;
+        }
+        j = &opts->job[opts->njob];
+        if (!(j->fnin = strdup(col[0])) || !(j->fnout = strdup(col[1]))
+            || !(j->rules = capmq_rules_dup(opts->rules))) {
+            perror("cannot allocate manifest jobs");
+            exit(1);
+        }
+        opts->njob++;
+        if (col[2] && *col[2]) {
+            parse_gfile(col[2], j->rules, capmq_set_rg_cap, opts->freemix);
+            if (opts->freemix) capmq_set_min_cap(j->rules, opts->minQ);
+        }
+        if (capmq_rules_empty(j->rules)) {
+            fprintf(stderr, "ERROR: %s line %d: nothing to do!\n", opts->manifest, line);
+            exit(1);
+        }
+    }
+    free(buf);
+    fclose(fh);
+}
+
 /*
  * Parse and validate command line arguments
  */
 static opts_t *parse_args(int argc, char **argv)
 {
-    htsFormat in_fmt = {0};
-    htsFormat out_fmt = {0};
-    int opt;
+    char **fnout = NULL, *fnin, *fnarg;
+    int nfnout = 0, opt;
+    bool have_files;
+
+    enum {
+        OPT_INPUT_THREADS = 1000,
+        OPT_OUTPUT_THREADS,
+        OPT_PIPELINE,
+        OPT_BATCH_SIZE,
+        OPT_BLOCK_PASSTHROUGH,
+        OPT_NO_RAW,
+        OPT_BY_REGION,
+        OPT_REGION_SIZE,
+        OPT_TMP_PREFIX,
+        OPT_WRITE_INDEX,
+        OPT_STATS,
+        OPT_SPLIT_RG,
+        OPT_SPLIT_MAX_OPEN,
+        OPT_SCAN,
+        OPT_MANIFEST,
+        OPT_JOBS,
+        OPT_CHECKPOINT,
+        OPT_CHECKPOINT_READS,
+        OPT_RESUME,
+        OPT_CAP_MQ,
+        OPT_REF_CACHE,
+        OPT_REF_SEQS,
+        OPT_PROGRESS,
+        OPT_PROGRESS_INTERVAL,
+    };
+    static const struct option lopts[] = {
+        { "threads",        required_argument, NULL, '@' },
+        { "input-threads",  required_argument, NULL, OPT_INPUT_THREADS },
+        { "output-threads", required_argument, NULL, OPT_OUTPUT_THREADS },
+        { "pipeline",       no_argument,       NULL, OPT_PIPELINE },
+        { "batch-size",     required_argument, NULL, OPT_BATCH_SIZE },
+        { "block-passthrough", no_argument,    NULL, OPT_BLOCK_PASSTHROUGH },
+        { "no-raw",         no_argument,       NULL, OPT_NO_RAW },
+        { "by-region",      no_argument,       NULL, OPT_BY_REGION },
+        { "region-size",    required_argument, NULL, OPT_REGION_SIZE },
+        { "tmp-prefix",     required_argument, NULL, OPT_TMP_PREFIX },
+        { "write-index",    optional_argument, NULL, OPT_WRITE_INDEX },
+        { "stats",          required_argument, NULL, OPT_STATS },
+        { "split-rg",       required_argument, NULL, OPT_SPLIT_RG },
+        { "split-max-open", required_argument, NULL, OPT_SPLIT_MAX_OPEN },
+        { "scan",           no_argument,       NULL, OPT_SCAN },
+        { "dry-run",        no_argument,       NULL, OPT_SCAN },
+        { "manifest",       required_argument, NULL, OPT_MANIFEST },
+        { "jobs",           required_argument, NULL, OPT_JOBS },
+        { "checkpoint",     required_argument, NULL, OPT_CHECKPOINT },
+        { "checkpoint-reads", required_argument, NULL, OPT_CHECKPOINT_READS },
+        { "resume",         no_argument,       NULL, OPT_RESUME },
+        { "cap-mq",         no_argument,       NULL, OPT_CAP_MQ },
+        { "ref-cache",      required_argument, NULL, OPT_REF_CACHE },
+        { "ref-seqs",       required_argument, NULL, OPT_REF_SEQS },
+        { "progress",       required_argument, NULL, OPT_PROGRESS },
+        { "progress-interval", required_argument, NULL, OPT_PROGRESS_INTERVAL },
+        { NULL, 0, NULL, 0 }
+    };
 
     opts_t* opts = calloc(sizeof(opts_t), 1);
     if (!opts) { perror("cannot allocate option parsing memory"); return NULL; }
 
-    opts->rgva = rgva_init(255);
+    if (!(opts->rules = capmq_rules_init())) {
+        perror("cannot allocate option parsing memory");
+        free(opts);
+        return NULL;
+    }
     opts->argv_list = stringify_argv(argc, argv);
-    opts->storeQ = true;
     opts->minQ = 0;
-    opts->capQ = 255;
+    opts->batch_size = 1000;
+    opts->max_jobs = 1;
+    opts->checkpoint_reads = 10000000;
+    opts->progress_interval = 10;
 
     // a bit hacky, but I need to know if -f is in effect before parsing -g or -G or -C
     if (strstr(opts->argv_list,"-f")) opts->freemix = true;
 
-    while ((opt = getopt(argc, argv, "m:g:G:I:O:C:sSrhvf")) != -1) {
+    while ((opt = getopt_long(argc, argv, "m:g:G:t:T:R:I:O:o:C:@:sSrhvf", lopts, NULL)) != -1) {
     switch (opt) {
-        case 'I': hts_parse_format(&in_fmt, optarg);
+        case 'I': hts_parse_format(&opts->in_fmt, optarg);
+                  break;
+
+        case 'O': hts_parse_format(&opts->out_fmt, optarg);
                   break;
 
-        case 'O': hts_parse_format(&out_fmt, optarg);
+        case 'o': {
+                      char **tmp = realloc(fnout, (nfnout+1) * sizeof(char *));
+                      if (!tmp) { perror("cannot allocate option parsing memory"); return NULL; }
+                      fnout = tmp;
+                      fnout[nfnout++] = optarg;
+                  }
                   break;
 
-        case 'C': opts->capQ = capq_from_str(optarg, opts->freemix);
+        case 'C': capmq_set_cap(opts->rules, capq_from_str(optarg, opts->freemix));
                   break;
 
-        case 's': opts->storeQ = true;
+        case 's': capmq_set_store(opts->rules, true);
                   break;
 
-        case 'S': opts->storeQ = false;
+        case 'S': capmq_set_store(opts->rules, false);
                   break;
 
-        case 'r': opts->restoreQ = true;
+        case 'r': capmq_set_restore(opts->rules, true);
                   break;
 
         case 'f': opts->freemix = true;
@@ -343,15 +1084,107 @@ static opts_t *parse_args(int argc, char **argv)
         case 'v': opts->verbose = true;
                   break;
 
-        case 'g': parse_rgv(opts->rgva, optarg, opts->freemix);
+        case 'g': parse_rgv(opts->rules, capmq_set_rg_cap, optarg, opts->freemix);
+                  break;
+
+        case 'G': parse_gfile(optarg, opts->rules, capmq_set_rg_cap, opts->freemix);
+                  break;
+
+        case 't': parse_rgv(opts->rules, capmq_set_contig_cap, optarg, opts->freemix);
+                  break;
+
+        case 'T': parse_gfile(optarg, opts->rules, capmq_set_contig_cap, opts->freemix);
                   break;
 
-        case 'G': parse_gfile(optarg,opts);
+        case 'R': parse_bedfile(optarg,opts);
                   break;
 
         case 'm': opts->minQ = uint8_from_str(optarg);
                   break;
 
+        case '@': opts->nthreads = int_from_str(optarg);
+                  break;
+
+        case OPT_INPUT_THREADS: opts->in_threads = int_from_str(optarg);
+                  break;
+
+        case OPT_OUTPUT_THREADS: opts->out_threads = int_from_str(optarg);
+                  break;
+
+        case OPT_PIPELINE: opts->pipeline = true;
+                  break;
+
+        case OPT_BATCH_SIZE: opts->batch_size = int_from_str(optarg);
+                  break;
+
+        case OPT_BLOCK_PASSTHROUGH: opts->passthrough = true;
+                  break;
+
+        case OPT_NO_RAW: opts->no_raw = true;
+                  break;
+
+        case OPT_BY_REGION: opts->by_region = true;
+                  break;
+
+        case OPT_REGION_SIZE: opts->region_size = int_from_str(optarg);
+                  break;
+
+        case OPT_TMP_PREFIX: opts->tmp_prefix = optarg;
+                  break;
+
+        case OPT_WRITE_INDEX: opts->write_index = true;
+                  if (!optarg || strcmp(optarg, "bai") == 0) {
+                      opts->index_min_shift = 0;
+                  } else if (strcmp(optarg, "csi") == 0) {
+                      opts->index_min_shift = 14;
+                  } else {
+                      fprintf(stderr, "ERROR: unknown index format '%s'\n", optarg);
+                      return NULL;
+                  }
+                  break;
+
+        case OPT_STATS: opts->stats_fn = optarg;
+                  break;
+
+        case OPT_SPLIT_RG: opts->split_fmt = optarg;
+                  break;
+
+        case OPT_SPLIT_MAX_OPEN: opts->split_max_open = int_from_str(optarg);
+                  break;
+
+        case OPT_SCAN: opts->scan = true;
+                  break;
+
+        case OPT_MANIFEST: opts->manifest = optarg;
+                  break;
+
+        case OPT_JOBS: opts->max_jobs = int_from_str(optarg);
+                  break;
+
+        case OPT_CHECKPOINT: opts->checkpoint_fn = optarg;
+                  break;
+
+        case OPT_CHECKPOINT_READS: opts->checkpoint_reads = int_from_str(optarg);
+                  break;
+
+        case OPT_RESUME: opts->resume = true;
+                  break;
+
+        case OPT_CAP_MQ: capmq_set_cap_mq(opts->rules, true);
+                  break;
+
+        case OPT_REF_CACHE: opts->ref_cache = optarg;
+                  break;
+
+        case OPT_REF_SEQS: opts->ref_seqs = optarg;
+                  break;
+
+        case OPT_PROGRESS: opts->progress_fn = optarg;
+                  break;
+
+        case OPT_PROGRESS_INTERVAL: opts->progress_interval = int_from_str(optarg);
+                  break;
+
         case 'h': usage(stdout);
                   return 0;
 
@@ -362,104 +1195,581 @@ static opts_t *parse_args(int argc, char **argv)
         }
     }
 
-    if (opts->capQ == 255 && !opts->restoreQ && !opts->rgva->end) {
+    // manifest jobs can bring caps of their own, so read_manifest() checks each one
+    if (!opts->manifest && capmq_rules_empty(opts->rules)) {
         fprintf(stderr, "Nothing to do!\n");
         return NULL;
     }
 
-    char *fnin = optind < argc ? argv[optind++] : "-";
-    if (!(opts->in = sam_open_format(fnin, "r", &in_fmt))) {
-        perror(argv[optind]);
-        return NULL;
+    have_files = optind < argc;
+    fnin = optind < argc ? argv[optind++] : "-";
+    // the second argument is the first output, followed by any given with -o
+    fnarg = optind < argc ? argv[optind++] : NULL;
+    if (opts->scan) {
+        if (fnarg || nfnout) {
+            fprintf(stderr, "ERROR: --scan writes no reads, so takes no output files\n");
+            free(fnout);
+            return NULL;
+        }
+        if (opts->passthrough || opts->by_region || opts->split_fmt || opts->write_index) {
+            fprintf(stderr, "ERROR: --scan cannot be used with --block-passthrough, --by-region, --split-rg or --write-index\n");
+            return NULL;
+        }
+        // the report is the only output
+        if (!opts->stats_fn) opts->stats_fn = "-";
     }
 
-    char mode[5] = "w";
-    char *fnout = optind < argc ? argv[optind++] : "-";
-    sam_open_mode(mode+1, fnout, NULL);
+    if (opts->manifest) {
+        if (have_files || nfnout) {
+            fprintf(stderr, "ERROR: --manifest takes its input and output files from the manifest\n");
+            free(fnout);
+            return NULL;
+        }
+        // these would all write the same files for every job
+        if (opts->stats_fn || opts->split_fmt || opts->tmp_prefix) {
+            fprintf(stderr, "ERROR: --manifest cannot be used with --stats, --scan, --split-rg or --tmp-prefix\n");
+            return NULL;
+        }
+        if (opts->max_jobs < 1) {
+            fprintf(stderr, "ERROR: --jobs must be at least 1\n");
+            return NULL;
+        }
+    }
 
-    if (!(opts->out = sam_open_format(fnout, mode, &out_fmt))) {
-        perror("(stdout)");
+    if (opts->resume && !opts->checkpoint_fn) {
+        fprintf(stderr, "ERROR: --resume needs the --checkpoint file to resume from\n");
         return NULL;
     }
-
-    rgva_sort(opts->rgva);
-
-    if (opts->freemix) {
-      if (opts->capQ < opts->minQ) {
-          if (opts->verbose) {
-              fprintf(stderr,
-                      "Default mapping quality cap calculated from freemix (%d) "
-                      "was lower than the minimum specifed by `-m' (%d), using "
-                      "the latter as the default mapping quality cap.\n",
-                      opts->capQ, opts->minQ);
-          }
-          opts->capQ = opts->minQ;
-      }
-      if (opts->rgva) {
-          int n;
-          for (n=0; n < opts->rgva->end; n++) {
-              rgv_t *rgv = opts->rgva->rgv[n];
-              if (rgv->capQ < opts->minQ) {
-                  if (opts->verbose) {
-                      fprintf(stderr,
-                              "Mapping quality cap calculated from freemix (%d) "
-                              "for read group `%s' was lower than the minimum "
-                              "specifed by `-m' (%d), using the latter as the "
-                              "mapping quality cap for this read group.\n",
-                              rgv->capQ, rgv->rg, opts->minQ);
-                  }
-                  rgv->capQ = opts->minQ;
-              }
-          }
-      }
+    if (opts->checkpoint_fn) {
+        // the output is a single file, written read by read
+        if (!fnarg || nfnout || opts->manifest || opts->pipeline || opts->passthrough || opts->by_region
+            || opts->split_fmt || opts->write_index) {
+            fprintf(stderr, "ERROR: --checkpoint needs a single output file, and cannot be used with --manifest,\n"
+                            "--pipeline, --block-passthrough, --by-region, --split-rg or --write-index\n");
+            free(fnout);
+            return NULL;
+        }
+        // the counts would only cover the reads after the checkpoint
+        if (opts->resume && opts->stats_fn) {
+            fprintf(stderr, "ERROR: --resume cannot be used with --stats\n");
+            return NULL;
+        }
+        if (opts->checkpoint_reads < 1) {
+            fprintf(stderr, "ERROR: --checkpoint-reads must be at least 1\n");
+            return NULL;
+        }
+    }
+
+    if (opts->stats_fn && !(opts->stats = stats_init())) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return NULL;
+    }
+
+    if (opts->batch_size < 1) {
+        fprintf(stderr, "ERROR: --batch-size must be at least 1\n");
+        return NULL;
+    }
+    if ((opts->pipeline || opts->by_region) && opts->nthreads == 0) opts->nthreads = 1;
+
+    if (opts->by_region && (opts->pipeline || opts->passthrough)) {
+        fprintf(stderr, "ERROR: --by-region cannot be used with --pipeline or --block-passthrough\n");
+        return NULL;
+    }
+
+    if (opts->split_fmt) {
+        if (!strstr(opts->split_fmt, "%r")) {
+            fprintf(stderr, "ERROR: --split-rg file names need %%r for the read group ID\n");
+            return NULL;
+        }
+        if (opts->passthrough || opts->by_region) {
+            fprintf(stderr, "ERROR: --split-rg cannot be used with --block-passthrough or --by-region\n");
+            return NULL;
+        }
+        // leave plenty of descriptors for everything else
+        if (!opts->split_max_open) {
+            struct rlimit rl;
+            opts->split_max_open = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+                                   ? rl.rlim_cur / 2 : 512;
+        }
+        if (opts->split_max_open < 1) {
+            fprintf(stderr, "ERROR: --split-max-open must be at least 1\n");
+            return NULL;
+        }
+    }
+
+    if (opts->write_index) {
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+        if (opts->passthrough || opts->by_region) {
+            fprintf(stderr, "ERROR: --write-index cannot be used with --block-passthrough or --by-region\n");
+            return NULL;
+        }
+#else
+        fprintf(stderr, "ERROR: --write-index needs htslib 1.10 or later\n");
+        return NULL;
+#endif
     }
 
+    if (opts->passthrough && opts->pipeline) {
+        fprintf(stderr, "ERROR: --block-passthrough cannot be used with --pipeline\n");
+        return NULL;
+    }
+
+    if (opts->ref_seqs && !opts->ref_cache) {
+        fprintf(stderr, "ERROR: --ref-seqs needs a --ref-cache directory to fill\n");
+        return NULL;
+    }
+    // htslib looks for CRAM reference sequences in REF_CACHE first, by MD5,
+    // and maps the files it finds there, so every job shares one copy
+    if (opts->ref_cache) {
+        kstring_t ks = {0, 0, NULL};
+        ksprintf(&ks, "%s/%%2s/%%2s/%%s", opts->ref_cache);
+        if (setenv("REF_CACHE", ks.s, 1) < 0) {
+            perror("REF_CACHE");
+            free(ks.s);
+            return NULL;
+        }
+        free(ks.s);
+    }
+
+    if (opts->progress_interval < 1) {
+        fprintf(stderr, "ERROR: --progress-interval must be at least 1\n");
+        return NULL;
+    }
+    if (opts->progress_fn) {
+        sigset_t set;
+        if (!(opts->progress = calloc(1, sizeof(progress_t)))) {
+            perror("cannot allocate option parsing memory");
+            return NULL;
+        }
+        // every thread started from here on inherits the mask, leaving
+        // SIGUSR1 to the thread that waits for it
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+
+    if (opts->nthreads > 0) {
+        if (!(opts->pool.pool = hts_tpool_init(opts->nthreads))) {
+            fprintf(stderr, "Failed to create thread pool\n");
+            return NULL;
+        }
+    }
+
+    capmq_set_verbose(opts->rules, opts->verbose);
+    if (opts->freemix) capmq_set_min_cap(opts->rules, opts->minQ);
+
+    if (opts->manifest) {
+        read_manifest(opts);
+    } else if (open_files(opts, fnin, fnarg, fnout, nfnout) < 0) {
+        free(fnout);
+        return NULL;
+    }
+    free(fnout);
+
     return opts;
 }
 
+// This thread's --progress counts, not yet added to the shared ones
+static __thread progress_t progress_local;
+
 /*
- * Process the file
+ * Add this thread's --progress counts to the shared ones
  */
-int capq(opts_t *opts)
+static void progress_flush(const opts_t *opts)
 {
-    bam_hdr_t *header;
-    bam1_t *b = NULL;
-    int ret;
-    uint8_t *om = NULL;
-    uint8_t *rg = NULL;
-    rgv_t *rgv = NULL;
-    int n;
+    progress_t *p = opts->progress, *l = &progress_local;
+
+    if (!p) return;
+    __atomic_fetch_add(&p->reads, l->reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->written, l->written, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->capped, l->capped, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->restored, l->restored, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->bytes, l->bytes, __ATOMIC_RELAXED);
+    if (l->reads) {
+        __atomic_store_n(&p->tid, l->tid, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->pos, l->pos, __ATOMIC_RELAXED);
+    }
+    memset(l, 0, sizeof(*l));
+}
+
+/*
+ * Count a read for --progress, given what capmq_apply() did to it
+ */
+static inline void progress_count(const opts_t *opts, int32_t tid, int64_t pos, size_t bytes, int changed, bool written)
+{
+    progress_t *l = &progress_local;
+
+    l->reads++;
+    l->written += written;
+    l->capped += (changed & (CAPMQ_CAPPED | CAPMQ_MQ_CAPPED)) != 0;
+    l->restored += changed == CAPMQ_RESTORED;
+    l->bytes += bytes;
+    l->tid = tid;
+    l->pos = pos;
+    if (l->reads >= PROGRESS_BATCH) progress_flush(opts);
+}
+
+// Count reads written for --progress, where that is separate from capping them
+static inline void progress_written(const opts_t *opts, int n)
+{
+    progress_t *l = &progress_local;
+
+    l->written += n;
+    if (l->written >= PROGRESS_BATCH) progress_flush(opts);
+}
+
+/*
+ * Cap (or restore) a read, counting it if --stats or --progress is in effect
+ */
+static inline void cap_record(const opts_t *opts, capmq_cursor_t *cache, capstats_t *stats, bam1_t *b)
+{
+    uint8_t qual = b->core.qual;
+    size_t bytes = 36 + b->l_data;
+    int changed = capmq_apply_cursor(opts->rules, cache, b);
+    bool restored = changed == CAPMQ_RESTORED;
+    if (opts->progress) progress_count(opts, b->core.tid, b->core.pos, bytes, changed, false);
+    if (stats) {
+        uint8_t *rg = bam_aux_get(b, "RG");
+        stats_count(stats, rg ? bam_aux2Z(rg) : NULL, b->core.tid, b->core.flag, qual, b->core.qual, restored);
+    }
+}
+
+/*
+ * As cap_record(), for a raw BAM record
+ */
+static inline int raw_cap_record(const opts_t *opts, capmq_cursor_t *cache, capstats_t *stats, const uint8_t *rec, size_t len, capmq_edit_t *e)
+{
+    uint16_t flag;
+    int32_t tid;
+
+    if (capmq_apply_raw(opts->rules, cache, rec, len, e) < 0) return -1;
+    if (opts->progress) {
+        int32_t pos;
+        memcpy(&tid, rec+4, 4);
+        memcpy(&pos, rec+8, 4);
+        // the raw engines pass every read to the output as they go
+        progress_count(opts, tid, pos, len, e->om || e->omq ? CAPMQ_RESTORED : (e->newq >= 0 || e->mq) ? CAPMQ_CAPPED : 0,
+                       opts->nout > 0);
+    }
+    if (stats) {
+        const char *rg = capmq_aux_str(capmq_aux_find(e->aux, rec + len, "RG"), rec + len);
+        memcpy(&tid, rec+4, 4);
+        memcpy(&flag, rec+18, 2);
+        // only restoring removes an om or mq tag
+        stats_count(stats, rg, tid, flag, rec[13], e->newq >= 0 ? e->newq : rec[13], e->om || e->omq);
+    }
+    return 0;
+}
+
+/*
+ * Expand a --split-rg file name for a read group
+ */
+static char *split_name(const char *fmt, const char *rg)
+{
+    kstring_t fn = {0, 0, NULL};
+    const char *p;
+    int r = 0;
+
+    for (p = fmt; *p && r >= 0; p++) {
+        if (p[0] == '%' && p[1] == 'r') r = kputs(rg, &fn), p++;
+        else if (p[0] == '%' && p[1] == '%') r = kputc('%', &fn), p++;
+        else r = kputc(*p, &fn);
+    }
+    if (r < 0) {
+        free(fn.s);
+        return NULL;
+    }
+    return fn.s;
+}
+
+/*
+ * The text of a header. htslib 1.10 and later drop it when a parsed header
+ * is changed, and build it again from the parsed lines here.
+ */
+static const char *header_text(bam_hdr_t *h, size_t *len)
+{
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    const char *text = sam_hdr_str(h);
+#else
+    const char *text = h->text;
+#endif
+    *len = text ? strnlen(text, h->l_text) : 0;
+    return text ? text : "";
+}
 
-    if (opts->verbose) {
-        fprintf(stderr, "Capping mapping qualities of %s to a maximum of %d by default\n", opts->in->fn, opts->capQ);
-        if (opts->rgva) {
-            for (n=0; n < opts->rgva->end; n++) {
-                rgv_t *rgv = opts->rgva->rgv[n];
-                fprintf(stderr, "Capping mapping qualities to a maximum of %d for read group %s\n", rgv->capQ, rgv->rg);
+/*
+ * Copy a header, keeping only the @RG line of one read group
+ */
+static bam_hdr_t *split_header(bam_hdr_t *h, const char *rg)
+{
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    bam_hdr_t *rh = bam_hdr_dup(h);
+
+    if (!rh || sam_hdr_remove_except(rh, "RG", "ID", rg) < 0) {
+        bam_hdr_destroy(rh);
+        return NULL;
+    }
+    return rh;
+#else
+    size_t textlen;
+    const char *line = header_text(h, &textlen), *end = line + textlen;
+    size_t rglen = strlen(rg);
+    kstring_t text = {0, 0, NULL};
+    bam_hdr_t *rh;
+
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line), *id;
+        size_t len;
+        if (!eol) eol = end;
+        if (!(eol - line > 3 && strncmp(line, "@RG\t", 4) == 0
+              && (!(id = capmq_hdr_field(line, eol, "ID", &len)) || len != rglen || memcmp(id, rg, len) != 0))) {
+            if (kputsn(line, eol - line, &text) < 0 || kputc('\n', &text) < 0) {
+                free(text.s);
+                return NULL;
             }
         }
+        line = eol + 1;
     }
 
-    // read header
-    if (!(header = sam_hdr_read(opts->in))) {
-        fprintf(stderr, "Failed to read file header\n");
-        return 1;
+    if (!(rh = bam_hdr_dup(h))) {
+        free(text.s);
+        return NULL;
     }
+    free(rh->text);
+    rh->text = text.s ? text.s : strdup("");
+    rh->l_text = text.l;
+    return rh;
+#endif
+}
 
-    // Add @PG line to header
-    SAM_hdr *sh = sam_hdr_parse_(header->text,header->l_text);
-    sam_hdr_add_PG(sh, "capmq",
-                   "VN", CAPMQ_VERSION,
-                   "CL", opts->argv_list,
-                   "DS", "cap map quality values",
-                   NULL, NULL);
-    sam_hdr_unparse2(sh,header);
-
-    // write new header
-    if (opts->out && sam_hdr_write(opts->out, header) != 0) {
-        fprintf(stderr, "Failed to write file header\n");
-        return 1;
+/*
+ * Set up an output file for each @RG line of the header. Nothing is
+ * opened until a read group has a read to write.
+ */
+static splitter_t *split_init(const opts_t *opts, bam_hdr_t *h)
+{
+    size_t textlen;
+    const char *line = header_text(h, &textlen), *end = line + textlen;
+    splitter_t *sp = calloc(1, sizeof(splitter_t));
+    bool is_cram = false;
+    int m = 0, r;
+
+    if (!sp || !(sp->idx = kh_init(rgsplit))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(sp);
+        return NULL;
+    }
+    sp->last = -1;
+    sp->max_open = opts->split_max_open;
+
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line), *id;
+        size_t len;
+        if (!eol) eol = end;
+        if (eol - line > 3 && strncmp(line, "@RG\t", 4) == 0 && (id = capmq_hdr_field(line, eol, "ID", &len))) {
+            split_t *s;
+            if (sp->n == m) {
+                split_t *tmp = realloc(sp->s, (m = m ? 2*m : 16) * sizeof(split_t));
+                if (!tmp) goto fail;
+                sp->s = tmp;
+            }
+            s = memset(&sp->s[sp->n], 0, sizeof(split_t));
+            if (!(s->rg = strndup(id, len))) goto fail;
+            kh_put(rgsplit, sp->idx, s->rg, &r);
+            if (r < 0) { free(s->rg); goto fail; }
+            if (r == 0) {
+                // a repeated @RG line
+                free(s->rg);
+            } else {
+                kh_val(sp->idx, kh_get(rgsplit, sp->idx, s->rg)) = sp->n++;
+                if (!(s->out.fn = split_name(opts->split_fmt, s->rg))
+                    || !(s->header = split_header(h, s->rg)))
+                    goto fail;
+                // as for -o, the file name gives the format if it can
+                strcpy(s->out.mode, "w");
+                s->out.fmt = opts->out_fmt;
+                if (sam_open_mode(s->out.mode+1, s->out.fn, NULL) == 0) s->out.fmt.format = unknown_format;
+                is_cram = strchr(s->out.mode, 'c') || s->out.fmt.format == cram;
+            }
+        }
+        line = eol + 1;
+    }
+
+    if (!sp->n) fprintf(stderr, "WARNING: no @RG lines in the header for --split-rg\n");
+    // files closed to stay under the limit are appended to when reopened,
+    // which CRAM cannot do
+    if (is_cram && sp->n > sp->max_open) {
+        fprintf(stderr, "ERROR: --split-rg can only write CRAM with all %d read group files open at once "
+                        "(see --split-max-open)\n", sp->n);
+        split_destroy(sp);
+        return NULL;
+    }
+    return sp;
+
+ fail:
+    fprintf(stderr, "Failed to allocate memory\n");
+    split_destroy(sp);
+    return NULL;
+}
+
+/*
+ * Cut the EOF marker block off the end of a BGZF file, so that appending
+ * to it does not leave the marker in the middle
+ */
+static int drop_bgzf_eof(const char *fn)
+{
+    uint8_t buf[28];
+    struct stat st;
+    FILE *fp;
+    bool eof;
+
+    if (stat(fn, &st) < 0) return -1;
+    if (st.st_size < 28) return 0;
+    if (!(fp = fopen(fn, "rb"))) return -1;
+    eof = fseeko(fp, -28, SEEK_END) == 0 && fread(buf, 1, 28, fp) == 28 && memcmp(buf, bgzf_eof, 28) == 0;
+    fclose(fp);
+    return eof ? truncate(fn, st.st_size - 28) : 0;
+}
+
+/*
+ * Write a read to its read group's file, opening it if need be and
+ * closing the least recently used file to make room.
+ */
+static int split_write(const opts_t *opts, splitter_t *sp, int i, const bam1_t *b)
+{
+    split_t *s = &sp->s[i];
+
+    if (!s->out.fp) {
+        if (sp->nopen >= sp->max_open) {
+            split_t *lru = NULL;
+            int j;
+            for (j = 0; j < sp->n; j++)
+                if (sp->s[j].out.fp && (!lru || sp->s[j].used < lru->used)) lru = &sp->s[j];
+            if (sam_close(lru->out.fp) < 0) {
+                lru->out.fp = NULL;
+                fprintf(stderr, "Failed to close %s\n", lru->out.fn);
+                return -1;
+            }
+            lru->out.fp = NULL;
+            sp->nopen--;
+        }
+        s->out.mode[0] = s->created ? 'a' : 'w';
+        if (s->created && drop_bgzf_eof(s->out.fn) < 0) {
+            perror(s->out.fn);
+            return -1;
+        }
+        if (!(s->out.fp = sam_open_format(s->out.fn, s->out.mode, &s->out.fmt))) {
+            perror(s->out.fn);
+            return -1;
+        }
+        sp->nopen++;
+        if (attach_threads(s->out.fp, opts->out_threads, &opts->pool) < 0) {
+            fprintf(stderr, "Failed to set up threads\n");
+            return -1;
+        }
+        if (!s->created) {
+            if (sam_hdr_write(s->out.fp, s->header) != 0) {
+                fprintf(stderr, "Failed to write header to %s\n", s->out.fn);
+                return -1;
+            }
+            s->created = true;
+        }
+    }
+    s->used = ++sp->clock;
+    return sam_write1(s->out.fp, s->header, b) < 0 ? -1 : 0;
+}
+
+/*
+ * Write a read to every output file, or to its read group's file, where
+ * the encoding is spread over the thread pool
+ */
+static int write_all(const opts_t *opts, const bam_hdr_t *header, const bam1_t *b)
+{
+    splitter_t *sp = opts->split;
+    int i;
+
+    // with --split-rg, only reads with no @RG line of their own go to the outputs
+    if (sp) {
+        const uint8_t *rg = bam_aux_get(b, "RG");
+        const char *id = rg ? bam_aux2Z(rg) : NULL;
+        if (id) {
+            if (sp->last < 0 || strcmp(sp->s[sp->last].rg, id) != 0) {
+                khint_t k = kh_get(rgsplit, sp->idx, id);
+                sp->last = k != kh_end(sp->idx) ? kh_val(sp->idx, k) : -1;
+            }
+            if (sp->last >= 0) {
+                if (split_write(opts, sp, sp->last, b) < 0) return -1;
+                if (opts->progress) progress_written(opts, 1);
+                return 0;
+            }
+        }
+    }
+    for (i = 0; i < opts->nout; i++)
+        if (sam_write1(opts->out[i].fp, header, b) < 0) return -1;
+    if (opts->progress && opts->nout) progress_written(opts, 1);
+    return 0;
+}
+
+/*
+ * Record how far the run has got. The output is first flushed to a block
+ * boundary and synced, so that everything the checkpoint covers is on
+ * disk, and the new checkpoint replaces the last in a single rename.
+ */
+static int write_checkpoint(opts_t *opts)
+{
+    const output_t *o = &opts->out[0];
+    BGZF *out = o->fp->fp.bgzf;
+    checkpoint_t *c = &opts->ckpt;
+    kstring_t tmp = {0, 0, NULL};
+    struct stat st;
+    FILE *fp;
+    int fd, ret = -1;
+
+    if (bgzf_flush(out) < 0 || hflush(out->fp) < 0) {
+        fprintf(stderr, "Failed to write to output file\n");
+        return -1;
+    }
+    // any descriptor will do to sync the file
+    if ((fd = open(o->fn, O_RDONLY)) < 0 || fsync(fd) < 0 || fstat(fd, &st) < 0) {
+        perror(o->fn);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    c->in_voff = bgzf_tell(opts->in->fp.bgzf);
+    c->out_size = st.st_size;
+
+    ksprintf(&tmp, "%s.tmp", opts->checkpoint_fn);
+    if (!(fp = fopen(tmp.s, "w"))) {
+        perror(tmp.s);
+        free(tmp.s);
+        return -1;
+    }
+    fprintf(fp, "capmq checkpoint\t%"PRId64"\t%"PRId64"\t%"PRIu64"\n", c->in_voff, c->out_size, c->reads);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) perror(tmp.s);
+    else ret = 0;
+    if (fclose(fp) != 0 && ret == 0) {
+        perror(tmp.s);
+        ret = -1;
     }
+    if (ret == 0 && rename(tmp.s, opts->checkpoint_fn) < 0) {
+        perror(opts->checkpoint_fn);
+        ret = -1;
+    }
+    free(tmp.s);
+    return ret;
+}
+
+/*
+ * Process the reads one at a time
+ */
+static int capq_serial(opts_t *opts, bam_hdr_t *header)
+{
+    capmq_cursor_t cache = {{0}};
+    capstats_t *stats = opts->stats;
+    bam1_t *b = NULL;
+    double t = stats ? stats_now() : 0;
+    int ret;
 
     b = bam_init1();
     if (!b) {
@@ -469,38 +1779,16 @@ int capq(opts_t *opts)
 
     // Loop over each read in the BAM file
     while ((ret = sam_read1(opts->in, header, b)) >= 0) {
-        if (b->core.tid >= 0) {
-            om = bam_aux_get(b, "om");
-
-            // the restore option overrides everything else
-            if (opts->restoreQ) {
-                if (om) {
-                    b->core.qual = bam_aux2i(om);   // restore quality
-                    bam_aux_del(b, om);             // delete om tag
-                }
-            } else {
-                uint8_t capQ = opts->capQ;
-                rg = bam_aux_get(b, "RG");
-                if (rg) {
-                    // handle -g / -G options
-                    char *rgtag = bam_aux2Z(rg);
-                    rgv = rgva_find(opts->rgva, rgtag);
-                    if (rgv) capQ = rgv->capQ;
-                }
-                if (b->core.qual > capQ) {
-                    if (opts->storeQ && !om) {
-                        // handle -s option
-                        int q = b->core.qual;
-                        bam_aux_append(b, "om", 'i', 4, (uint8_t*)&q);
-                    }
-                    b->core.qual = capQ;
-                }
-            }
-        }
-        if (sam_write1(opts->out, header, b) < 0) {
+        if (stats) t = stats_phase(stats, PHASE_DECODE, t);
+        cap_record(opts, &cache, stats, b);
+        if (stats) t = stats_phase(stats, PHASE_PROCESS, t);
+        if (write_all(opts, header, b) < 0) {
             fprintf(stderr, "Failed to write to output file\n");
             return 1;
         }
+        if (opts->checkpoint_fn && ++opts->ckpt.reads % opts->checkpoint_reads == 0
+            && write_checkpoint(opts) < 0) return 1;
+        if (stats) t = stats_phase(stats, PHASE_ENCODE, t);
     }
     if (ret < -1) {
         fprintf(stderr, "Error reading input.\n");
@@ -508,11 +1796,1684 @@ int capq(opts_t *opts)
     }
 
     bam_destroy1(b);
-    bam_hdr_destroy(header);
 
     return 0;
 }
 
+// A batch of reads passed between the pipeline stages
+typedef struct {
+    bam1_t **bams;
+    int n;      // number of reads in use
+    int max;    // number of reads allocated
+    const opts_t *opts;
+    bam_hdr_t *header;
+    capstats_t *stats;  // for --stats, merged by the writer
+    kstring_t text;     // the reads as NUL terminated SAM lines (sam_text_in)
+    kstring_t out;      // the capped reads formatted as SAM (sam_text_out)
+    kstring_t line;     // scratch space for formatting
+    const char *error;  // set by a worker that failed
+} batch_t;
+
+// Pipeline state shared by the reader, the workers and the writer
+typedef struct {
+    opts_t *opts;
+    bam_hdr_t *header;
+    hts_tpool_process *q;
+    pthread_mutex_t lock;
+    pthread_cond_t avail;
+    batch_t **free;     // batches ready to be refilled
+    int nfree;
+    bool failed;        // set by the writer on error; use pipeline_failed()
+} pipeline_t;
+
+static batch_t *batch_init(const opts_t *opts, bam_hdr_t *header, int max)
+{
+    int n;
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    if (!batch) return NULL;
+    batch->opts = opts;
+    batch->header = header;
+    batch->max = max;
+    batch->bams = calloc(max, sizeof(bam1_t *));
+    if (!batch->bams) { free(batch); return NULL; }
+    if (opts->stats && !(batch->stats = stats_init())) {
+        free(batch->bams);
+        free(batch);
+        return NULL;
+    }
+    for (n=0; n < max; n++) {
+        if (!(batch->bams[n] = bam_init1())) {
+            while (n--) bam_destroy1(batch->bams[n]);
+            stats_destroy(batch->stats);
+            free(batch->bams);
+            free(batch);
+            return NULL;
+        }
+    }
+    return batch;
+}
+
+static void batch_destroy(batch_t *batch)
+{
+    int n;
+    if (!batch) return;
+    for (n=0; n < batch->max; n++) bam_destroy1(batch->bams[n]);
+    stats_destroy(batch->stats);
+    free(batch->bams);
+    free(batch->text.s);
+    free(batch->out.s);
+    free(batch->line.s);
+    free(batch);
+}
+
+/*
+ * Parse the SAM lines of a batch into its reads.
+ * Returns 0 on success, -1 on failure.
+ */
+static int parse_batch(batch_t *batch)
+{
+    char *s = batch->text.s;
+    int n;
+    for (n=0; n < batch->n; n++) {
+        kstring_t line = { 0, 0, s };
+        line.l = strlen(s);
+        line.m = line.l + 1;
+        s += line.m;
+        if (sam_parse1(&line, batch->header, batch->bams[n]) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Format the reads of a batch as SAM lines, ready for writing.
+ * Returns 0 on success, -1 on failure.
+ */
+static int format_batch(batch_t *batch)
+{
+    int n;
+    batch->out.l = 0;
+    for (n=0; n < batch->n; n++) {
+        if (sam_format1(batch->header, batch->bams[n], &batch->line) < 0
+            || kputsn(batch->line.s, batch->line.l, &batch->out) < 0
+            || kputc('\n', &batch->out) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Worker: cap every read in a batch, parsing and formatting it here
+ * when the input or the outputs are SAM text
+ */
+static void *cap_batch(void *arg)
+{
+    batch_t *batch = arg;
+    const opts_t *opts = batch->opts;
+    capmq_cursor_t cache = {{0}};
+    double t = batch->stats ? stats_now() : 0;
+    int n;
+    batch->error = NULL;
+    if (opts->sam_text_in) {
+        if (parse_batch(batch) < 0) {
+            batch->error = "Error reading input.";
+            return batch;
+        }
+        if (batch->stats) stats_phase(batch->stats, PHASE_DECODE, t);
+        t = batch->stats ? stats_now() : 0;
+    }
+    for (n=0; n < batch->n; n++) cap_record(opts, &cache, batch->stats, batch->bams[n]);
+    if (batch->stats) stats_phase(batch->stats, PHASE_PROCESS, t);
+    if (opts->sam_text_out) {
+        t = batch->stats ? stats_now() : 0;
+        if (format_batch(batch) < 0) batch->error = "Failed to format reads";
+        if (batch->stats) stats_phase(batch->stats, PHASE_ENCODE, t);
+    }
+    // pool threads go on to other work, so count a batch at a time
+    progress_flush(opts);
+    return batch;
+}
+
+// Whether the writer has failed, which the reader checks without the lock
+static inline bool pipeline_failed(pipeline_t *p)
+{
+    return __atomic_load_n(&p->failed, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Take a free batch, waiting for the writer to return one if necessary.
+ * Returns NULL once the writer has failed.
+ */
+static batch_t *pipeline_get_batch(pipeline_t *p)
+{
+    batch_t *batch = NULL;
+    pthread_mutex_lock(&p->lock);
+    while (!p->nfree && !pipeline_failed(p)) pthread_cond_wait(&p->avail, &p->lock);
+    if (!pipeline_failed(p)) batch = p->free[--p->nfree];
+    pthread_mutex_unlock(&p->lock);
+    return batch;
+}
+
+/*
+ * Wait until n batches are free, that is every one still in flight has
+ * been through the writer
+ */
+static void pipeline_wait_free(pipeline_t *p, int n)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->nfree < n) pthread_cond_wait(&p->avail, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Writer: record a failure, waking the reader so that it stops
+ */
+static void pipeline_fail(pipeline_t *p)
+{
+    pthread_mutex_lock(&p->lock);
+    __atomic_store_n(&p->failed, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&p->avail);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pipeline_put_batch(pipeline_t *p, batch_t *batch)
+{
+    pthread_mutex_lock(&p->lock);
+    p->free[p->nfree++] = batch;
+    pthread_cond_signal(&p->avail);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Writer thread: write the capped batches in the order they were read.
+ * An empty batch marks the end of the input.
+ */
+static void *pipeline_writer(void *arg)
+{
+    pipeline_t *p = arg;
+    hts_tpool_result *r;
+    bool done = false;
+    int n;
+
+    while (!done && (r = hts_tpool_next_result_wait(p->q))) {
+        batch_t *batch = hts_tpool_result_data(r);
+        double t = batch->stats ? stats_now() : 0;
+        hts_tpool_delete_result(r, 0);
+        done = batch->n == 0;
+        if (batch->error && !pipeline_failed(p)) {
+            fprintf(stderr, "%s\n", batch->error);
+            pipeline_fail(p);
+        }
+        // after a failure keep draining, returning the batches to the reader.
+        // SAM text formatted by the workers goes out in one write.
+        for (n=0; p->opts->sam_text_out && batch->n && n < p->opts->nout && !pipeline_failed(p); n++) {
+            hFILE *fp = p->opts->out[n].fp->fp.hfile;
+            if (hwrite(fp, batch->out.s, batch->out.l) != (ssize_t) batch->out.l) {
+                fprintf(stderr, "Failed to write to output file\n");
+                pipeline_fail(p);
+            }
+        }
+        if (p->opts->progress && p->opts->sam_text_out) progress_written(p->opts, batch->n);
+        for (n=0; !p->opts->sam_text_out && n < batch->n && !pipeline_failed(p); n++) {
+            if (write_all(p->opts, p->header, batch->bams[n]) < 0) {
+                fprintf(stderr, "Failed to write to output file\n");
+                pipeline_fail(p);
+            }
+        }
+        progress_flush(p->opts);
+        if (batch->stats) {
+            stats_phase(batch->stats, PHASE_ENCODE, t);
+            if (stats_merge(p->opts->stats, batch->stats) < 0) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                pipeline_fail(p);
+            }
+        }
+        pipeline_put_batch(p, batch);
+    }
+    return NULL;
+}
+
+/*
+ * Fill a batch with unparsed SAM lines, each NUL terminated, for the
+ * workers to parse. Returns 0, -1 at the end of the input or < -1 on error.
+ */
+static int read_text_batch(samFile *in, batch_t *batch, kstring_t *line)
+{
+    int ret = 0;
+    batch->text.l = 0;
+    while (batch->n < batch->max) {
+        // htslib holds on to the line following the header
+        if (in->line.l) {
+            ret = kputsn(in->line.s, in->line.l, &batch->text);
+            in->line.l = 0;
+        } else if ((ret = hts_getline(in, KS_SEP_LINE, line)) < 0) {
+            break;
+        } else {
+            ret = kputsn(line->s, line->l, &batch->text);
+        }
+        if (ret < 0 || kputc('\0', &batch->text) < 0) return -2;
+        batch->n++;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Process the reads in batches: the main thread reads, workers from the
+ * thread pool cap, and a writer thread writes the batches back in order.
+ * Memory is bounded by the fixed number of batches in circulation. SAM
+ * text is parsed and formatted by the workers too, the reader and writer
+ * only splitting the input into lines and writing out whole batches.
+ */
+static int capq_pipeline(opts_t *opts, bam_hdr_t *header)
+{
+    pipeline_t p = { .opts = opts, .header = header };
+    pthread_t writer;
+    kstring_t line = { 0, 0, NULL };
+    int qsize = hts_tpool_size(opts->pool.pool) * 2;
+    int nbatches = qsize + 2;
+    int n, ret = 0, status = 0;
+    bool eof = false;
+    double decode = 0;  // the writer owns opts->stats until it finishes
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.avail, NULL);
+    if (!(p.free = calloc(nbatches, sizeof(batch_t *)))) {
+        fprintf(stderr, "Failed to allocate batches\n");
+        return 1;
+    }
+    for (n=0; n < nbatches; n++) {
+        if (!(p.free[p.nfree] = batch_init(opts, header, opts->batch_size))) {
+            fprintf(stderr, "Failed to allocate batches\n");
+            status = 1;
+            goto cleanup;
+        }
+        p.nfree++;
+    }
+    if (!(p.q = hts_tpool_process_init(opts->pool.pool, qsize, 0))) {
+        fprintf(stderr, "Failed to create thread pool queue\n");
+        status = 1;
+        goto cleanup;
+    }
+    // sam_parse1() looks up reference names in a table the header builds
+    // on first use, so build it before the workers share the header
+    if (opts->sam_text_in) bam_name2id(header, "*");
+    if (pthread_create(&writer, NULL, pipeline_writer, &p) != 0) {
+        fprintf(stderr, "Failed to create writer thread\n");
+        status = 1;
+        goto cleanup;
+    }
+
+    for (;;) {
+        batch_t *batch = pipeline_get_batch(&p);
+        double t = opts->stats ? stats_now() : 0;
+        if (!batch) {
+            // the writer failed, and drains what is in flight without
+            // waiting for the final empty batch
+            pipeline_wait_free(&p, nbatches);
+            hts_tpool_process_shutdown(p.q);
+            break;
+        }
+        batch->n = 0;
+        if (opts->sam_text_in) {
+            if (!eof && !pipeline_failed(&p) && (ret = read_text_batch(opts->in, batch, &line)) < 0) eof = true;
+        }
+        while (!opts->sam_text_in && !eof && !pipeline_failed(&p) && batch->n < batch->max) {
+            if ((ret = sam_read1(opts->in, header, batch->bams[batch->n])) < 0) eof = true;
+            else batch->n++;
+        }
+        if (opts->stats) decode += stats_now() - t;
+        // the final batch is always empty, telling the writer to stop
+        bool last = batch->n == 0;
+        if (hts_tpool_dispatch(opts->pool.pool, p.q, cap_batch, batch) < 0) {
+            fprintf(stderr, "Failed to dispatch batch\n");
+            batch_destroy(batch);
+            status = 1;
+            // as above, once the batches already dispatched are back
+            pipeline_wait_free(&p, --nbatches);
+            hts_tpool_process_shutdown(p.q);
+            break;
+        }
+        if (last) break;
+    }
+    pthread_join(writer, NULL);
+    if (opts->stats) opts->stats->time[PHASE_DECODE] += decode;
+
+    if (ret < -1) {
+        fprintf(stderr, "Error reading input.\n");
+        status = 1;
+    }
+    if (pipeline_failed(&p)) status = 1;
+
+ cleanup:
+    if (p.q) hts_tpool_process_destroy(p.q);
+    for (n=0; n < p.nfree; n++) batch_destroy(p.free[n]);
+    free(p.free);
+    free(line.s);
+    pthread_cond_destroy(&p.avail);
+    pthread_mutex_destroy(&p.lock);
+    return status;
+}
+
+// A compressed block held back by the passthrough engine
+typedef struct {
+    uint8_t *comp;      // the original BGZF block, or NULL if it must be recompressed
+    size_t comp_len;
+    uint64_t end;       // stream offset just past this block's data
+    bool dirty;         // holds part of a read that changed
+} pblock_t;
+
+// A change to the uncompressed stream, applied as the data is written
+typedef struct {
+    uint64_t off;       // stream offset the change applies at
+    enum { PATCH_SET, PATCH_DELETE, PATCH_INSERT_AFTER } type;
+    uint32_t len;       // bytes to delete or insert
+    uint8_t data[14];   // the byte to set, or the bytes to insert
+} patch_t;
+
+// State of the passthrough engine
+typedef struct {
+    uint8_t *data;      // uncompressed data not yet written
+    size_t len, max;
+    uint64_t base;      // stream offset of data[0]
+    uint64_t parsed;    // stream offset of the first read not yet examined
+    pblock_t *blocks;   // blocks not yet written, in order
+    int nblocks, maxblocks;
+    patch_t *patches;   // patches not yet applied, in order
+    int npatches, maxpatches, patch0;
+    z_stream zs;
+    uint8_t *cbuf;      // buffer for reading a compressed block
+    uint64_t nclean, ndirty;
+} passthrough_t;
+
+static int pass_add_patch(passthrough_t *pt, uint64_t off, int type, uint32_t len, const void *data)
+{
+    patch_t *p;
+    if (pt->npatches == pt->maxpatches) {
+        int max = pt->maxpatches ? pt->maxpatches * 2 : 1024;
+        patch_t *patches = realloc(pt->patches, max * sizeof(patch_t));
+        if (!patches) return -1;
+        pt->patches = patches;
+        pt->maxpatches = max;
+    }
+    p = &pt->patches[pt->npatches++];
+    p->off = off;
+    p->type = type;
+    p->len = len;
+    if (data) memcpy(p->data, data, type == PATCH_SET ? 1 : len);
+    return 0;
+}
+
+/*
+ * Record the changes for one read as patches on the stream, and mark every
+ * block holding part of it as dirty
+ */
+static int pass_edit_record(passthrough_t *pt, const uint8_t *rec, uint64_t off, size_t len, capmq_edit_t *e)
+{
+    // the aux changes, which must go in as patches in stream order
+    const uint8_t *cut[2] = { e->om, e->omq }, *mq = e->mq;
+    uint32_t cut_len[2] = { e->om_len, e->omq_len };
+    int32_t oldq = rec[13], oldmq = e->add_mq ? bam_aux2i(e->mq) : 0;
+    uint8_t tags[14];
+    uint32_t block_size;
+    uint64_t start;
+    size_t ntags = 0;
+    int n, i, c;
+
+    memcpy(&block_size, rec, 4);
+    if (e->add_om) block_size += 7;
+    if (e->add_mq) block_size += 7;
+    block_size -= cut_len[0] + cut_len[1];
+    for (i=0; i < 4; i++) {
+        uint8_t byte = block_size >> (8*i);
+        if (pass_add_patch(pt, off+i, PATCH_SET, 1, &byte) < 0) return -1;
+    }
+    uint8_t q = e->newq;
+    if (e->newq >= 0 && pass_add_patch(pt, off+13, PATCH_SET, 1, &q) < 0) return -1;
+    if (!cut[0] || (cut[1] && cut[1] < cut[0])) {
+        cut[0] = e->omq; cut_len[0] = e->omq_len;
+        cut[1] = e->om; cut_len[1] = e->om_len;
+    }
+    for (c = 0; c <= 2; c++) {
+        // the MQ value goes in before any tag cut out after it
+        if (mq && (c == 2 || !cut[c] || mq < cut[c])) {
+            // MQ keeps its type, as the new value fits it
+            int size = strchr("cC", *mq) ? 1 : strchr("sS", *mq) ? 2 : 4;
+            for (i = 0; i < size; i++) {
+                uint8_t byte = (uint32_t)e->newmq >> (8*i);
+                if (pass_add_patch(pt, off + (mq+1 - rec) + i, PATCH_SET, 1, &byte) < 0) return -1;
+            }
+            mq = NULL;
+        }
+        if (c < 2 && cut[c] && pass_add_patch(pt, off + (cut[c] - rec), PATCH_DELETE, cut_len[c], NULL) < 0) return -1;
+    }
+    if (e->add_om) {
+        memcpy(tags, "omi", 3);
+        memcpy(tags+3, &oldq, 4);
+        ntags += 7;
+    }
+    if (e->add_mq) {
+        memcpy(tags+ntags, "mqi", 3);
+        memcpy(tags+ntags+3, &oldmq, 4);
+        ntags += 7;
+    }
+    if (ntags && pass_add_patch(pt, off+len-1, PATCH_INSERT_AFTER, ntags, tags) < 0) return -1;
+
+    // the read is usually in the last block or two, so search backwards
+    for (n = pt->nblocks-1; n >= 0; n--) {
+        start = n ? pt->blocks[n-1].end : pt->base;
+        if (pt->blocks[n].end > off && start < off+len) pt->blocks[n].dirty = true;
+        if (start <= off) break;
+    }
+    return 0;
+}
+
+/*
+ * Write the uncompressed stream in [pos, end), applying any patches,
+ * for compression into new blocks
+ */
+static int pass_write_patched(passthrough_t *pt, BGZF *out, uint64_t pos, uint64_t end)
+{
+    while (pos < end) {
+        patch_t *p = pt->patch0 < pt->npatches ? &pt->patches[pt->patch0] : NULL;
+        uint64_t stop = p && p->off < end ? p->off : end;
+        if (stop > pos) {
+            if (bgzf_write(out, pt->data + (pos - pt->base), stop - pos) < 0) return -1;
+            pos = stop;
+        }
+        if (!p || p->off >= end) break;
+        switch (p->type) {
+            case PATCH_SET:
+                if (bgzf_write(out, p->data, 1) < 0) return -1;
+                pos++;
+                pt->patch0++;
+                break;
+            case PATCH_DELETE:
+                // a deletion may carry on into the next block
+                if (p->off + p->len > end) {
+                    p->len -= end - p->off;
+                    p->off = end;
+                    pos = end;
+                } else {
+                    pos = p->off + p->len;
+                    pt->patch0++;
+                }
+                break;
+            case PATCH_INSERT_AFTER:
+                // the byte may already be written, by a PATCH_SET of an MQ tag
+                if (p->off == pos) {
+                    if (bgzf_write(out, pt->data + (pos - pt->base), 1) < 0) return -1;
+                    pos++;
+                }
+                if (bgzf_write(out, p->data, p->len) < 0) return -1;
+                pt->patch0++;
+                break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write out every held block that no partially examined read overlaps:
+ * clean blocks are copied verbatim, dirty ones recompressed after patching.
+ * Returns -1 on error, and -2 if blocks are left over when flushing.
+ */
+static int pass_emit(passthrough_t *pt, BGZF *out, bool flushing)
+{
+    uint64_t start = pt->base;
+    int n;
+
+    for (n=0; n < pt->nblocks && pt->blocks[n].end <= pt->parsed; n++) {
+        pblock_t *blk = &pt->blocks[n];
+        if (blk->dirty || !blk->comp) {
+            if (pass_write_patched(pt, out, start, blk->end) < 0) return -1;
+            pt->ndirty++;
+        } else {
+            // finish any recompressed data before copying the original block
+            if (bgzf_flush(out) < 0 || bgzf_raw_write(out, blk->comp, blk->comp_len) < 0) return -1;
+            pt->nclean++;
+        }
+        free(blk->comp);
+        blk->comp = NULL;
+        start = blk->end;
+    }
+    if (n) {
+        // drop the data and blocks written
+        size_t used = start - pt->base;
+        memmove(pt->data, pt->data + used, pt->len - used);
+        pt->len -= used;
+        pt->base = start;
+        memmove(pt->blocks, pt->blocks + n, (pt->nblocks - n) * sizeof(pblock_t));
+        pt->nblocks -= n;
+    }
+    if (pt->patch0 == pt->npatches) pt->patch0 = pt->npatches = 0;
+    return flushing && pt->nblocks ? -2 : 0;
+}
+
+/*
+ * Add a block's uncompressed data to the window
+ */
+static int pass_add_block(passthrough_t *pt, const void *data, size_t len, uint8_t *comp, size_t comp_len)
+{
+    if (pt->len + len > pt->max) {
+        size_t max = pt->max ? pt->max : BGZF_MAX_BLOCK_SIZE * 4;
+        while (max < pt->len + len) max *= 2;
+        uint8_t *d = realloc(pt->data, max);
+        if (!d) return -1;
+        pt->data = d;
+        pt->max = max;
+    }
+    if (pt->nblocks == pt->maxblocks) {
+        int max = pt->maxblocks ? pt->maxblocks * 2 : 16;
+        pblock_t *b = realloc(pt->blocks, max * sizeof(pblock_t));
+        if (!b) return -1;
+        pt->blocks = b;
+        pt->maxblocks = max;
+    }
+    memcpy(pt->data + pt->len, data, len);
+    pt->len += len;
+    pt->blocks[pt->nblocks].comp = comp;
+    pt->blocks[pt->nblocks].comp_len = comp_len;
+    pt->blocks[pt->nblocks].end = pt->base + pt->len;
+    pt->blocks[pt->nblocks].dirty = false;
+    pt->nblocks++;
+    return 0;
+}
+
+/*
+ * Read the next raw BGZF block from the input and decompress it.
+ * Returns 1 on success, 0 at end of file and -1 on error.
+ */
+static int pass_read_block(passthrough_t *pt, BGZF *in, uint8_t *ubuf, size_t *ulen, uint8_t **comp, size_t *comp_len)
+{
+    uint8_t *h = pt->cbuf;
+    ssize_t n = bgzf_raw_read(in, h, 18);
+    size_t bsize;
+    uint32_t crc, isize;
+
+    if (n == 0) return 0;
+    if (n != 18 || h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4)
+        || h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C') {
+        fprintf(stderr, "Input is not a valid BGZF file\n");
+        return -1;
+    }
+    bsize = (h[16] | h[17] << 8) + 1;
+    if (bsize < 26 || bgzf_raw_read(in, h+18, bsize-18) != (ssize_t)(bsize-18)) {
+        fprintf(stderr, "Truncated BGZF block in input\n");
+        return -1;
+    }
+    memcpy(&crc, h + bsize-8, 4);
+    memcpy(&isize, h + bsize-4, 4);
+    if (isize > BGZF_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid BGZF block size in input\n");
+        return -1;
+    }
+
+    inflateReset(&pt->zs);
+    pt->zs.next_in = h+18;
+    pt->zs.avail_in = bsize-26;
+    pt->zs.next_out = ubuf;
+    pt->zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+    if (inflate(&pt->zs, Z_FINISH) != Z_STREAM_END || pt->zs.total_out != isize
+        || crc32(crc32(0L, NULL, 0), ubuf, isize) != crc) {
+        fprintf(stderr, "Failed to decompress BGZF block in input\n");
+        return -1;
+    }
+    *ulen = isize;
+    if (!(*comp = malloc(bsize))) return -1;
+    memcpy(*comp, h, bsize);
+    *comp_len = bsize;
+    return 1;
+}
+
+/*
+ * BAM to BAM: copy every compressed block in which no read changes
+ * verbatim, and only recompress the blocks that do change
+ */
+static int capq_passthrough(opts_t *opts, bam_hdr_t *header)
+{
+    BGZF *in = opts->in->fp.bgzf;
+    BGZF *out = opts->out[0].fp->fp.bgzf;
+    passthrough_t pt = {0};
+    capmq_cursor_t cache = {{0}};
+    capstats_t *stats = opts->stats;
+    uint8_t *ubuf = NULL, *comp;
+    size_t ulen, comp_len;
+    double t = stats ? stats_now() : 0;
+    int ret, status = 1;
+
+    if (inflateInit2(&pt.zs, -15) != Z_OK) {
+        fprintf(stderr, "Failed to initialise zlib\n");
+        return 1;
+    }
+    if (!(pt.cbuf = malloc(BGZF_MAX_BLOCK_SIZE)) || !(ubuf = malloc(BGZF_MAX_BLOCK_SIZE))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        goto cleanup;
+    }
+
+    // finish the header's blocks before copying anything
+    if (bgzf_flush(out) < 0) {
+        fprintf(stderr, "Failed to write to output file\n");
+        goto cleanup;
+    }
+
+    // the rest of the block holding the end of the header has to be recompressed
+    if (in->block_offset < in->block_length
+        && pass_add_block(&pt, (uint8_t *)in->uncompressed_block + in->block_offset,
+                          in->block_length - in->block_offset, NULL, 0) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        goto cleanup;
+    }
+
+    do {
+        if ((ret = pass_read_block(&pt, in, ubuf, &ulen, &comp, &comp_len)) < 0) goto cleanup;
+        if (stats) t = stats_phase(stats, PHASE_DECODE, t);
+        if (ret > 0) {
+            // empty blocks are EOF markers; bgzf_close() writes our own
+            if (ulen == 0) {
+                free(comp);
+                continue;
+            }
+            if (pass_add_block(&pt, ubuf, ulen, comp, comp_len) < 0) {
+                free(comp);
+                fprintf(stderr, "Failed to allocate memory\n");
+                goto cleanup;
+            }
+        }
+
+        // examine every read now complete in the window
+        for (;;) {
+            uint64_t avail = pt.base + pt.len - pt.parsed;
+            const uint8_t *rec = pt.data + (pt.parsed - pt.base);
+            uint32_t block_size;
+            capmq_edit_t e;
+
+            if (avail < 4) break;
+            memcpy(&block_size, rec, 4);
+            if (avail < 4 + (uint64_t)block_size) break;
+            if (raw_cap_record(opts, &cache, stats, rec, 4 + (size_t)block_size, &e) < 0) {
+                fprintf(stderr, "Malformed BAM record in input\n");
+                goto cleanup;
+            }
+            if ((e.newq >= 0 || e.mq) && pass_edit_record(&pt, rec, pt.parsed, 4 + (size_t)block_size, &e) < 0) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                goto cleanup;
+            }
+            pt.parsed += 4 + (uint64_t)block_size;
+        }
+        if (stats) t = stats_phase(stats, PHASE_PROCESS, t);
+
+        switch (pass_emit(&pt, out, ret == 0)) {
+            case -1:
+                fprintf(stderr, "Failed to write to output file\n");
+                goto cleanup;
+            case -2:
+                fprintf(stderr, "Truncated BAM record at end of input\n");
+                goto cleanup;
+        }
+        if (stats) t = stats_phase(stats, PHASE_ENCODE, t);
+    } while (ret > 0);
+
+    if (opts->verbose)
+        fprintf(stderr, "Copied %"PRIu64" blocks unchanged and recompressed %"PRIu64"\n", pt.nclean, pt.ndirty);
+    status = 0;
+
+ cleanup:
+    while (pt.nblocks) free(pt.blocks[--pt.nblocks].comp);
+    inflateEnd(&pt.zs);
+    free(pt.blocks);
+    free(pt.patches);
+    free(pt.data);
+    free(pt.cbuf);
+    free(ubuf);
+    return status;
+}
+
+#define RAW_CHUNK (4 * BGZF_MAX_BLOCK_SIZE)
+
+/*
+ * BAM to BAM without unpacking the reads: walk the uncompressed stream in
+ * large chunks, pass runs of unchanged records straight to the output and
+ * edit the records that change in place. Restoring removes om tags, so
+ * the records after one are copied forward once to close the gaps. Only
+ * records that gain an om tag are rebuilt in a separate buffer.
+ */
+static int capq_raw(opts_t *opts)
+{
+    BGZF *in = opts->in->fp.bgzf;
+    BGZF *out = opts->nout ? opts->out[0].fp->fp.bgzf : NULL;    // NULL when scanning
+    size_t in_max = RAW_CHUNK, in_len = 0, edit_max = 0;
+    uint8_t *ibuf = malloc(in_max), *ebuf = NULL;
+    capmq_cursor_t cache = {{0}};
+    capstats_t *stats = opts->stats;
+    double t = stats ? stats_now() : 0;
+    ssize_t n;
+    int status = 1;
+
+    if (!ibuf) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    do {
+        size_t pos = 0, run = 0, w = 0;     // run to w: records not yet written
+
+        if ((n = bgzf_read(in, ibuf + in_len, in_max - in_len)) < 0) {
+            fprintf(stderr, "Error reading input.\n");
+            goto cleanup;
+        }
+        in_len += n;
+        if (stats) t = stats_phase(stats, PHASE_DECODE, t);
+
+        while (in_len - pos >= 4) {
+            const uint8_t *rec = ibuf + pos;
+            uint32_t block_size;
+            size_t len;
+            capmq_edit_t e;
+
+            memcpy(&block_size, rec, 4);
+            len = 4 + (size_t)block_size;
+            if (in_len - pos < len) break;
+            if (raw_cap_record(opts, &cache, stats, rec, len, &e) < 0) {
+                fprintf(stderr, "Malformed BAM record in input\n");
+                goto cleanup;
+            }
+            if (!(e.newq >= 0 || e.mq) || !out) {
+                if (w < pos) memmove(ibuf + w, rec, len);
+                w += len;
+            } else if (!e.add_om && !e.add_mq) {
+                w += capmq_edit_raw(ibuf + w, rec, len, &e);
+            } else {
+                if (len + 14 > edit_max) {
+                    uint8_t *b = realloc(ebuf, len + 14);
+                    if (!b) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        goto cleanup;
+                    }
+                    ebuf = b;
+                    edit_max = len + 14;
+                }
+                size_t elen = capmq_edit_raw(ebuf, rec, len, &e);
+                if (stats) t = stats_phase(stats, PHASE_PROCESS, t);
+                if ((w > run && bgzf_write(out, ibuf + run, w - run) < 0)
+                    || bgzf_write(out, ebuf, elen) < 0) {
+                    fprintf(stderr, "Failed to write to output file\n");
+                    goto cleanup;
+                }
+                if (stats) t = stats_phase(stats, PHASE_ENCODE, t);
+                run = w = pos + len;
+            }
+            pos += len;
+        }
+        if (stats) t = stats_phase(stats, PHASE_PROCESS, t);
+        if (out && w > run && bgzf_write(out, ibuf + run, w - run) < 0) {
+            fprintf(stderr, "Failed to write to output file\n");
+            goto cleanup;
+        }
+        if (stats) t = stats_phase(stats, PHASE_ENCODE, t);
+
+        // keep any partial record for the next chunk
+        memmove(ibuf, ibuf + pos, in_len - pos);
+        in_len -= pos;
+        if (in_len == in_max) {
+            uint8_t *b = realloc(ibuf, in_max * 2);
+            if (!b) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                goto cleanup;
+            }
+            ibuf = b;
+            in_max *= 2;
+        }
+    } while (n > 0);
+
+    if (in_len) {
+        fprintf(stderr, "Truncated BAM record at end of input\n");
+        goto cleanup;
+    }
+    status = 0;
+
+ cleanup:
+    free(ibuf);
+    free(ebuf);
+    return status;
+}
+
+// A piece of the genome capped on its own by the --by-region engine
+typedef struct {
+    int tid;            // first reference, or HTS_IDX_NOCOOR for the unplaced reads
+    int ntids;          // number of whole references, or 0 for [beg,end) of tid alone
+    int64_t beg, end;
+    char *tmpfn;        // capped reads, until they are joined onto the output
+    const opts_t *opts;
+    const bam_hdr_t *header;
+    capstats_t *stats;  // for --stats, merged as the region is joined
+    int status;
+} region_t;
+
+/*
+ * Worker: cap the reads of one region into its temporary file.
+ * Each region opens the input and its index for itself so that regions never
+ * share a file position, and does its own (unthreaded) decompression and
+ * compression, as the regions themselves are what run on the pool.
+ */
+static void *region_job(void *arg)
+{
+    region_t *r = arg;
+    const opts_t *opts = r->opts;
+    bool is_bam = hts_get_format(opts->out[0].fp)->format == bam;
+    samFile *in = NULL, *out = NULL;
+    bam_hdr_t *h = NULL, *oh = NULL;
+    hts_idx_t *idx = NULL;
+    bam1_t *b = NULL;
+    capmq_cursor_t cache = {{0}};
+    capstats_t *stats = NULL;
+    double t = 0;
+    int tid, last = r->ntids ? r->tid + r->ntids - 1 : r->tid;
+    int ret = -1;
+
+    r->status = 1;
+    if (opts->stats) {
+        if (!(stats = r->stats = stats_init())) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return r;
+        }
+        t = stats_now();
+    }
+    if (!(in = sam_open_format(opts->fnin, "r", &opts->in_fmt))
+        || !(h = sam_hdr_read(in))
+        || !(idx = sam_index_load(in, opts->fnin))
+        || (opts->cram_no_md && hts_set_opt(in, CRAM_OPT_DECODE_MD, 0) != 0)) {
+        fprintf(stderr, "Failed to open %s with its index\n", opts->fnin);
+        goto cleanup;
+    }
+    // BAM regions are bare BGZF blocks of records; CRAM needs its header
+    if (!(oh = bam_hdr_dup(r->header))
+        || !(out = sam_open_format(r->tmpfn, opts->out[0].mode, &opts->out[0].fmt))
+        || (hts_get_format(out)->format == cram && sam_hdr_write(out, oh) != 0)) {
+        fprintf(stderr, "Failed to create temporary file %s\n", r->tmpfn);
+        goto cleanup;
+    }
+    if (!(b = bam_init1())) {
+        fprintf(stderr, "Failed to allocate bam struct\n");
+        goto cleanup;
+    }
+
+    for (tid = r->tid; tid <= last && ret == -1; tid++) {
+        hts_itr_t *itr = sam_itr_queryi(idx, tid, r->ntids ? 0 : r->beg, r->ntids ? INT_MAX : r->end);
+        if (!itr) {
+            fprintf(stderr, "Failed to query the index of %s\n", opts->fnin);
+            goto cleanup;
+        }
+        while ((ret = sam_itr_next(in, itr, b)) >= 0) {
+            // reads overlapping the start of a region belong to the one before
+            if (b->core.pos < r->beg && !r->ntids && r->beg > 0) continue;
+            if (stats) t = stats_phase(stats, PHASE_DECODE, t);
+            cap_record(opts, &cache, stats, b);
+            if (stats) t = stats_phase(stats, PHASE_PROCESS, t);
+            if ((is_bam ? bam_write1(out->fp.bgzf, b) : sam_write1(out, oh, b)) < 0) {
+                fprintf(stderr, "Failed to write to %s\n", r->tmpfn);
+                hts_itr_destroy(itr);
+                goto cleanup;
+            }
+            if (opts->progress) progress_written(opts, 1);
+            if (stats) t = stats_phase(stats, PHASE_ENCODE, t);
+        }
+        hts_itr_destroy(itr);
+    }
+    if (ret < -1) {
+        fprintf(stderr, "Error reading input.\n");
+        goto cleanup;
+    }
+    r->status = 0;
+
+ cleanup:
+    progress_flush(opts);
+    if (out && sam_close(out) < 0) r->status = 1;
+    bam_destroy1(b);
+    if (idx) hts_idx_destroy(idx);
+    if (h) bam_hdr_destroy(h);
+    if (oh) bam_hdr_destroy(oh);
+    if (in) sam_close(in);
+    return r;
+}
+
+/*
+ * Split the references into regions of about size bases: small references
+ * are grouped together and large ones cut into pieces. The unplaced reads
+ * make up the last region.
+ */
+static region_t *make_regions(const opts_t *opts, const bam_hdr_t *header, int64_t size, int *nregions)
+{
+    region_t *regions;
+    int64_t group = 0, beg;
+    int tid, n = 0, max = 1;
+
+    for (tid = 0; tid < header->n_targets; tid++)
+        max += header->target_len[tid] / size + 1;
+    if (!(regions = calloc(max, sizeof(region_t)))) return NULL;
+
+    for (tid = 0; tid < header->n_targets; tid++) {
+        int64_t len = header->target_len[tid];
+        if (len > size) {
+            for (beg = 0; beg < len; beg += size) {
+                regions[n].tid = tid;
+                regions[n].beg = beg;
+                regions[n++].end = beg + size < len ? beg + size : INT_MAX;
+            }
+        } else if (n && regions[n-1].ntids && group + len <= size) {
+            regions[n-1].ntids++;
+            group += len;
+        } else {
+            regions[n].tid = tid;
+            regions[n++].ntids = 1;
+            group = len;
+        }
+    }
+    regions[n++].tid = HTS_IDX_NOCOOR;
+
+    for (tid = 0; tid < n; tid++) {
+        kstring_t fn = {0, 0, NULL};
+        ksprintf(&fn, "%s.%d.%04d.tmp", opts->tmp_prefix, (int)getpid(), tid);
+        regions[tid].tmpfn = fn.s;
+        regions[tid].opts = opts;
+        regions[tid].header = header;
+    }
+    *nregions = n;
+    return regions;
+}
+
+/*
+ * Append a CRAM region to the output container by container,
+ * leaving out its EOF container
+ */
+static int append_cram(samFile *out, const char *fn)
+{
+    samFile *in = sam_open(fn, "rc");
+    bam_hdr_t *h = NULL;
+    cram_container *c;
+    cram_block *blk;
+    int32_t num_slices;
+    int ret = -1;
+
+    if (!in || !(h = sam_hdr_read(in))) goto cleanup;
+    while ((c = cram_read_container(in->fp.cram))) {
+        bool empty = cram_container_is_empty(in->fp.cram);
+        if ((!empty && cram_write_container(out->fp.cram, c) != 0)
+            || !(blk = cram_read_block(in->fp.cram))) {
+            cram_free_container(c);
+            goto cleanup;
+        }
+        if (!empty && cram_write_block(out->fp.cram, blk) != 0) {
+            cram_free_block(blk);
+            cram_free_container(c);
+            goto cleanup;
+        }
+        cram_free_block(blk);
+        if (!empty) {
+            (void)cram_container_get_landmarks(c, &num_slices);
+            if (cram_copy_slice(in->fp.cram, out->fp.cram, num_slices) != 0) {
+                cram_free_container(c);
+                goto cleanup;
+            }
+        }
+        cram_free_container(c);
+    }
+    ret = 0;
+
+ cleanup:
+    if (h) bam_hdr_destroy(h);
+    if (in) sam_close(in);
+    return ret;
+}
+
+/*
+ * Append a region's temporary file to the output: CRAM by container,
+ * BGZF by raw block (dropping the EOF block) and plain SAM as it is
+ */
+static int append_region(opts_t *opts, const char *fn)
+{
+    samFile *out = opts->out[0].fp;
+    uint8_t buf[65536];
+    struct stat st;
+    hFILE *fp;
+    off_t left;
+    ssize_t n;
+
+    if (hts_get_format(out)->format == cram) return append_cram(out, fn);
+
+    if (stat(fn, &st) < 0 || !(fp = hopen(fn, "r"))) return -1;
+    left = st.st_size;
+    if (out->is_bgzf) {
+        // the final block of a BGZF file is the EOF marker
+        if (left >= 28 && (hseek(fp, -28, SEEK_END) < 0 || hread(fp, buf, 28) != 28
+                           || hseek(fp, 0, SEEK_SET) < 0)) {
+            hclose(fp);
+            return -1;
+        }
+        if (left >= 28 && memcmp(buf, bgzf_eof, 28) == 0) left -= 28;
+        if (bgzf_flush(out->fp.bgzf) < 0) {
+            hclose(fp);
+            return -1;
+        }
+    }
+    for (; left > 0; left -= n) {
+        if ((n = hread(fp, buf, left < (off_t)sizeof(buf) ? left : (off_t)sizeof(buf))) <= 0) break;
+        if ((out->is_bgzf ? bgzf_raw_write(out->fp.bgzf, buf, n) : hwrite(out->fp.hfile, buf, n)) != n) break;
+    }
+    if (hclose(fp) < 0) return -1;
+    return left ? -1 : 0;
+}
+
+/*
+ * Whether the @HD line of a header gives SO:coordinate
+ */
+static bool coordinate_sorted(bam_hdr_t *h)
+{
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    kstring_t so = {0, 0, NULL};
+    bool sorted = sam_hdr_find_tag_hd(h, "SO", &so) == 0 && strcmp(so.s, "coordinate") == 0;
+    free(so.s);
+    return sorted;
+#else
+    char *so = h->text && strncmp(h->text, "@HD\t", 4) == 0 ? strstr(h->text, "\tSO:") : NULL;
+    return so && so < strchr(h->text, '\n') && strncmp(so, "\tSO:coordinate", 14) == 0
+           && (so[14] == '\t' || so[14] == '\n');
+#endif
+}
+
+/*
+ * Coordinate sorted, indexed input: cap regions of the genome independently
+ * on the thread pool and join their outputs back together in order
+ */
+static int capq_by_region(opts_t *opts, bam_hdr_t *header)
+{
+    hts_tpool *pool = opts->pool.pool;
+    hts_tpool_process *q = NULL;
+    region_t *regions = NULL;
+    int64_t size = opts->region_size, total = 0;
+    int n, nregions = 0, next = 0, done = 0, status = 0;
+
+    // fail early rather than in every region
+    hts_idx_t *idx = sam_index_load(opts->in, opts->fnin);
+    if (!idx) {
+        fprintf(stderr, "ERROR: failed to load the index of %s\n", opts->fnin);
+        return 1;
+    }
+    hts_idx_destroy(idx);
+
+    // by default aim for a few regions per thread
+    if (!size) {
+        for (n = 0; n < header->n_targets; n++) total += header->target_len[n];
+        size = total / (4 * hts_tpool_size(pool));
+        if (size < 1000000) size = 1000000;
+    }
+    if (!(regions = make_regions(opts, header, size, &nregions))) {
+        fprintf(stderr, "Failed to allocate regions\n");
+        return 1;
+    }
+    if (opts->verbose) fprintf(stderr, "Capping %d regions of up to %"PRId64" bases\n", nregions, size);
+
+    if (!(q = hts_tpool_process_init(pool, hts_tpool_size(pool) * 2, 0))) {
+        fprintf(stderr, "Failed to create thread pool queue\n");
+        status = 1;
+        goto cleanup;
+    }
+
+    // keep the queue full while joining the finished regions in order;
+    // after a failure stop dispatching and just drain what is running
+    for (;;) {
+        while (!status && next < nregions) {
+            if (hts_tpool_dispatch2(pool, q, region_job, &regions[next], 1) < 0) {
+                if (errno != EAGAIN) {
+                    fprintf(stderr, "Failed to dispatch region\n");
+                    status = 1;
+                }
+                break;
+            }
+            next++;
+        }
+        if (done == next) break;
+
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        region_t *region = hts_tpool_result_data(r);
+        double t = opts->stats ? stats_now() : 0;
+        hts_tpool_delete_result(r, 0);
+        if (region->status) {
+            status = 1;
+        } else if (!status && append_region(opts, region->tmpfn) < 0) {
+            fprintf(stderr, "Failed to append %s to the output\n", region->tmpfn);
+            status = 1;
+        }
+        unlink(region->tmpfn);
+        if (region->stats) {
+            stats_phase(region->stats, PHASE_ENCODE, t);
+            if (stats_merge(opts->stats, region->stats) < 0) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                status = 1;
+            }
+            stats_destroy(region->stats);
+            region->stats = NULL;
+        }
+        done++;
+    }
+
+ cleanup:
+    if (q) hts_tpool_process_destroy(q);
+    for (n = 0; n < nregions; n++) free(regions[n].tmpfn);
+    free(regions);
+    return status;
+}
+
+// Write a JSON string
+static void json_str(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", *s);
+        else fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void json_counts(FILE *fp, const rgcount_t *c)
+{
+    fprintf(fp, "{\"reads\": %"PRIu64", \"mapped\": %"PRIu64", \"capped\": %"PRIu64", \"restored\": %"PRIu64"}",
+            c->reads, c->mapped, c->capped, c->restored);
+}
+
+// Write a MAPQ histogram, leaving off the trailing zeros
+static void json_hist(FILE *fp, const uint64_t *h)
+{
+    int i, n = 256;
+    while (n > 0 && !h[n-1]) n--;
+    fputc('[', fp);
+    for (i = 0; i < n; i++) fprintf(fp, "%s%"PRIu64, i ? ", " : "", h[i]);
+    fputc(']', fp);
+}
+
+/*
+ * Write the --stats report
+ */
+static int write_stats(const opts_t *opts, const bam_hdr_t *h, const char *engine, double wall)
+{
+    const capstats_t *s = opts->stats;
+    struct rusage ru;
+    khint_t k;
+    bool first = true;
+    bool to_stdout = strcmp(opts->stats_fn, "-") == 0;
+    FILE *fp = to_stdout ? stdout : fopen(opts->stats_fn, "w");
+    int i;
+
+    if (!fp) {
+        perror(opts->stats_fn);
+        return -1;
+    }
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(fp, "{\n  \"version\": ");
+    json_str(fp, CAPMQ_VERSION);
+    fprintf(fp, ",\n  \"command\": ");
+    json_str(fp, opts->argv_list);
+    fprintf(fp, ",\n  \"engine\": \"%s\",\n  \"threads\": %d,\n  \"total\": ", engine, opts->nthreads);
+    json_counts(fp, &s->all);
+    fprintf(fp, ",\n  \"read_groups\": {");
+    for (k = kh_begin(s->rg); k != kh_end(s->rg); k++) {
+        if (!kh_exist(s->rg, k)) continue;
+        fprintf(fp, "%s\n    ", first ? "" : ",");
+        json_str(fp, kh_key(s->rg, k));
+        fprintf(fp, ": ");
+        json_counts(fp, &kh_val(s->rg, k));
+        first = false;
+    }
+    fprintf(fp, "%s},\n  \"contigs\": {", first ? "" : "\n  ");
+    first = true;
+    for (i = 0; i < s->nctg && i < h->n_targets; i++) {
+        if (!s->ctg[i].reads) continue;
+        fprintf(fp, "%s\n    ", first ? "" : ",");
+        json_str(fp, h->target_name[i]);
+        fprintf(fp, ": ");
+        json_counts(fp, &s->ctg[i]);
+        first = false;
+    }
+    fprintf(fp, "%s},\n  \"mapq_before\": ", first ? "" : "\n  ");
+    json_hist(fp, s->before);
+    fprintf(fp, ",\n  \"mapq_after\": ");
+    json_hist(fp, s->after);
+    fprintf(fp, ",\n  \"time\": {\"wall\": %.3f, \"user\": %.3f, \"system\": %.3f, "
+                "\"decode\": %.3f, \"process\": %.3f, \"encode\": %.3f}\n}\n",
+            wall, ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6, ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6,
+            s->time[PHASE_DECODE], s->time[PHASE_PROCESS], s->time[PHASE_ENCODE]);
+
+    if ((to_stdout ? fflush(fp) : fclose(fp)) != 0) {
+        perror(opts->stats_fn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Create the directories leading to a file, as far as they do not exist
+ */
+static int make_parents(char *path)
+{
+    char *p;
+    for (p = strchr(path+1, '/'); p; p = strchr(p+1, '/')) {
+        *p = 0;
+        if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+            perror(path);
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+/*
+ * Add a sequence from the FASTA file to the reference cache, as upper case
+ * bases alone, provided it matches the MD5 in the header. It is written to
+ * a file of its own and renamed into place, so jobs sharing the cache can
+ * fill it at the same time. A sequence that is missing or does not match
+ * is left for htslib to find elsewhere.
+ */
+static int ref_cache_add(const opts_t *opts, faidx_t *fai, const char *name, const char *md5, char *path)
+{
+    hts_md5_context *ctx;
+    unsigned char digest[16];
+    char hex[33];
+    kstring_t tmp = {0, 0, NULL};
+    int len, i, j, fd, ret = -1;
+    char *seq = faidx_fetch_seq(fai, name, 0, INT_MAX, &len);
+
+    if (!seq) {
+        fprintf(stderr, "Warning: no sequence %s in %s\n", name, opts->ref_seqs);
+        return 0;
+    }
+    for (i = j = 0; i < len; i++)
+        if (seq[i] > ' ' && seq[i] <= '~') seq[j++] = toupper((unsigned char)seq[i]);
+    if (!(ctx = hts_md5_init())) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(seq);
+        return -1;
+    }
+    hts_md5_update(ctx, seq, j);
+    hts_md5_final(digest, ctx);
+    hts_md5_destroy(ctx);
+    hts_md5_hex(hex, digest);
+    if (strcmp(hex, md5) != 0) {
+        fprintf(stderr, "Warning: sequence %s in %s does not match its M5 tag\n", name, opts->ref_seqs);
+        free(seq);
+        return 0;
+    }
+
+    ksprintf(&tmp, "%s.XXXXXX", path);
+    if (make_parents(tmp.s) < 0 || (fd = mkstemp(tmp.s)) < 0) {
+        perror(tmp.s);
+        goto cleanup;
+    }
+    // the cache is read by other users' jobs too
+    if (fchmod(fd, 0644) < 0 || write(fd, seq, j) != j || close(fd) < 0) {
+        perror(tmp.s);
+        unlink(tmp.s);
+        goto cleanup;
+    }
+    if (rename(tmp.s, path) < 0) {
+        perror(path);
+        unlink(tmp.s);
+        goto cleanup;
+    }
+    if (opts->verbose) fprintf(stderr, "Added %s to the reference cache as %s\n", name, path);
+    ret = 0;
+
+ cleanup:
+    free(tmp.s);
+    free(seq);
+    return ret;
+}
+
+/*
+ * Fill in the reference cache from the --ref-seqs FASTA file, for every
+ * @SQ line with an M5 tag whose sequence is not already there
+ */
+static int ref_cache_fill(const opts_t *opts, const bam_hdr_t *h)
+{
+    const char *line = h->text, *end = h->text + h->l_text;
+    kstring_t path = {0, 0, NULL};
+    faidx_t *fai = NULL;
+    int ret = 0;
+
+    while (line < end && ret == 0) {
+        const char *eol = memchr(line, '\n', end - line), *sn, *m5;
+        size_t sn_len, m5_len;
+        struct stat st;
+        char md5[33], *name;
+        int i;
+
+        if (!eol) eol = end;
+        if (eol - line > 3 && strncmp(line, "@SQ\t", 4) == 0
+            && (sn = capmq_hdr_field(line, eol, "SN", &sn_len))
+            && (m5 = capmq_hdr_field(line, eol, "M5", &m5_len)) && m5_len == 32) {
+            for (i = 0; i < 32; i++) md5[i] = tolower((unsigned char)m5[i]);
+            md5[32] = 0;
+            // laid out as REF_CACHE=DIR/%2s/%2s/%s expects
+            path.l = 0;
+            ksprintf(&path, "%s/%.2s/%.2s/%s", opts->ref_cache, md5, md5+2, md5+4);
+            if (stat(path.s, &st) < 0) {
+                if (!fai && !(fai = fai_load(opts->ref_seqs))) {
+                    fprintf(stderr, "Failed to load %s with its index\n", opts->ref_seqs);
+                    ret = -1;
+                } else if (!(name = strndup(sn, sn_len))) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    ret = -1;
+                } else {
+                    ret = ref_cache_add(opts, fai, name, md5, path.s);
+                    free(name);
+                }
+            }
+        }
+        line = eol + 1;
+    }
+    if (fai) fai_destroy(fai);
+    free(path.s);
+    return ret;
+}
+
+/*
+ * Process the file
+ */
+int capq(opts_t *opts)
+{
+    bam_hdr_t *header;
+    const char *engine;
+    double start = stats_now();
+    int ret = 1, i;
+
+    // the read group and contig caps are listed as the rules are prepared
+    if (opts->verbose)
+        fprintf(stderr, "Capping mapping qualities of %s to a maximum of %d by default\n", opts->in->fn, capmq_get_cap(opts->rules));
+
+    // read header
+    if (!(header = sam_hdr_read(opts->in))) {
+        fprintf(stderr, "Failed to read file header\n");
+        return 1;
+    }
+    if (opts->by_region && !coordinate_sorted(header)) {
+        fprintf(stderr, "ERROR: --by-region needs coordinate sorted input\n");
+        goto cleanup;
+    }
+    if (capmq_rules_prepare(opts->rules, header) < 0) goto cleanup;
+    if (opts->ref_seqs && ref_cache_fill(opts, header) < 0) goto cleanup;
+
+    // Add @PG line to header
+    if (capmq_add_pg(header, opts->argv_list) < 0) {
+        fprintf(stderr, "Failed to add @PG line to header\n");
+        goto cleanup;
+    }
+
+    if (opts->split_fmt && !(opts->split = split_init(opts, header))) goto cleanup;
+
+    // write new header, unless it went out before the checkpoint
+    for (i = 0; i < opts->nout && !opts->resuming; i++) {
+        output_t *o = &opts->out[i];
+        if (sam_hdr_write(o->fp, header) != 0) {
+            fprintf(stderr, "Failed to write file header\n");
+            goto cleanup;
+        }
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+        if (o->fnidx && sam_idx_init(o->fp, header, o->index_min_shift, o->fnidx) < 0) {
+            fprintf(stderr, "Failed to initialise index %s\n", o->fnidx);
+            goto cleanup;
+        }
+#endif
+    }
+
+    if (opts->resuming) {
+        if (opts->verbose)
+            fprintf(stderr, "Resuming after %"PRIu64" reads\n", opts->ckpt.reads);
+        if (bgzf_seek(opts->in->fp.bgzf, opts->ckpt.in_voff, SEEK_SET) < 0) {
+            fprintf(stderr, "Failed to seek to the checkpoint in %s\n", opts->fnin);
+            goto cleanup;
+        }
+    }
+
+    if (opts->by_region) {
+        engine = "by-region";
+        ret = capq_by_region(opts, header);
+    } else if (opts->passthrough) {
+        engine = "block-passthrough";
+        ret = capq_passthrough(opts, header);
+    } else if (opts->raw) {
+        engine = "raw";
+        ret = capq_raw(opts);
+    } else if (opts->pipeline) {
+        engine = "pipeline";
+        ret = capq_pipeline(opts, header);
+    } else {
+        engine = "serial";
+        ret = capq_serial(opts, header);
+    }
+    progress_flush(opts);
+
+    if (split_destroy(opts->split) < 0) ret = 1;
+    opts->split = NULL;
+
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    for (i = 0; i < opts->nout && !ret; i++) {
+        if (opts->out[i].fnidx && sam_idx_save(opts->out[i].fp) < 0) {
+            fprintf(stderr, "Failed to write index %s\n", opts->out[i].fnidx);
+            ret = 1;
+        }
+    }
+#endif
+
+    if (!ret && opts->stats && write_stats(opts, header, engine, stats_now() - start) < 0) ret = 1;
+
+cleanup:
+    bam_hdr_destroy(header);
+    return ret;
+}
+
+// The jobs of a --manifest run, shared by the workers
+typedef struct {
+    opts_t *opts;
+    int next;           // next job to start
+    int failed;
+    pthread_mutex_t lock;
+} manifest_t;
+
+/*
+ * Run one manifest job with its own files and rules, and everything
+ * else, the thread pool included, shared with the other jobs.
+ * Returns 0 on success, 1 on failure.
+ */
+static int run_job(const opts_t *base, job_t *j)
+{
+    opts_t opts = *base;
+    int ret;
+
+    opts.rules = j->rules;
+    opts.in = NULL;
+    opts.out = NULL;
+    opts.nout = 0;
+    ret = open_files(&opts, j->fnin, j->fnout, NULL, 0) < 0 ? 1 : capq(&opts);
+    if (close_files(&opts) < 0) ret = 1;
+    capmq_rules_destroy(j->rules);
+    j->rules = NULL;
+    return ret;
+}
+
+static void *manifest_worker(void *arg)
+{
+    manifest_t *m = arg;
+    int i, ret;
+
+    for (;;) {
+        double start = stats_now();
+        pthread_mutex_lock(&m->lock);
+        i = m->next++;
+        pthread_mutex_unlock(&m->lock);
+        if (i >= m->opts->njob) break;
+
+        ret = run_job(m->opts, &m->opts->job[i]);
+
+        pthread_mutex_lock(&m->lock);
+        printf("%s\t%s\t%s\t%.3f\n", m->opts->job[i].fnin, m->opts->job[i].fnout,
+               ret ? "failed" : "ok", stats_now() - start);
+        fflush(stdout);
+        if (ret) m->failed++;
+        pthread_mutex_unlock(&m->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Run the jobs of a --manifest file, up to --jobs of them at once, printing
+ * the input, output, status and seconds taken of each as it finishes.
+ * A failed job does not stop the others. Returns 1 if any job failed.
+ */
+static int run_manifest(opts_t *opts)
+{
+    manifest_t m = { opts, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    int nworkers = opts->max_jobs < opts->njob ? opts->max_jobs : opts->njob, i, n;
+    pthread_t *workers = malloc((nworkers ? nworkers : 1) * sizeof(pthread_t));
+
+    if (!workers) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    for (n = 0; n < nworkers; n++) {
+        if (pthread_create(&workers[n], NULL, manifest_worker, &m) != 0) {
+            fprintf(stderr, "Failed to start manifest job threads\n");
+            break;
+        }
+    }
+    // carry on with the threads that did start
+    if (n == 0) {
+        free(workers);
+        return 1;
+    }
+    for (i = 0; i < n; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    if (opts->verbose)
+        fprintf(stderr, "%d of %d jobs failed\n", m.failed, opts->njob);
+    return m.failed ? 1 : 0;
+}
+
+// Reports kept for the --progress moving average
+#define PROGRESS_WINDOW 6
+
+// The --progress reporting thread
+typedef struct {
+    const opts_t *opts;
+    pthread_t thread;
+    double start;
+    double t[PROGRESS_WINDOW];      // times and read counts of recent reports
+    uint64_t reads[PROGRESS_WINDOW];
+    int n;
+    bool done;          // set when the run is over, for a last report
+    bool failed;        // the report could not be written, said once
+} reporter_t;
+
+/*
+ * Write the --progress report: the shared counts, the position of the
+ * latest reads and the rate, overall and over the last few reports
+ */
+static void write_progress(reporter_t *r, bool done)
+{
+    const opts_t *opts = r->opts;
+    const progress_t *p = opts->progress;
+    bool to_stderr = strcmp(opts->progress_fn, "-") == 0;
+    kstring_t tmp = {0, 0, NULL};
+    double now = stats_now();
+    uint64_t reads = __atomic_load_n(&p->reads, __ATOMIC_RELAXED);
+    int oldest = r->n < PROGRESS_WINDOW ? 0 : r->n % PROGRESS_WINDOW;
+    double window = now - r->t[oldest];
+    uint64_t window_reads = reads - r->reads[oldest];
+    FILE *fp;
+
+    r->t[r->n % PROGRESS_WINDOW] = now;
+    r->reads[r->n % PROGRESS_WINDOW] = reads;
+    r->n++;
+
+    if (to_stderr) {
+        fp = stderr;
+    } else if (ksprintf(&tmp, "%s.tmp", opts->progress_fn) < 0 || !(fp = fopen(tmp.s, "w"))) {
+        if (!r->failed) perror(opts->progress_fn);
+        r->failed = true;
+        free(tmp.s);
+        return;
+    }
+    fprintf(fp, "{\"elapsed\": %.3f, \"reads\": %"PRIu64", \"written\": %"PRIu64", \"capped\": %"PRIu64
+            ", \"restored\": %"PRIu64", \"bytes\": %"PRIu64", \"tid\": %d, \"pos\": %"PRId64
+            ", \"reads_per_sec\": %.1f, \"recent_reads_per_sec\": %.1f, \"done\": %s}\n",
+            now - r->start, reads, __atomic_load_n(&p->written, __ATOMIC_RELAXED),
+            __atomic_load_n(&p->capped, __ATOMIC_RELAXED), __atomic_load_n(&p->restored, __ATOMIC_RELAXED),
+            __atomic_load_n(&p->bytes, __ATOMIC_RELAXED), __atomic_load_n(&p->tid, __ATOMIC_RELAXED),
+            __atomic_load_n(&p->pos, __ATOMIC_RELAXED),
+            now > r->start ? reads / (now - r->start) : 0.0,
+            window > 0 ? window_reads / window : 0.0, done ? "true" : "false");
+    if (to_stderr) {
+        fflush(fp);
+        return;
+    }
+    // readers only ever see a whole report
+    if (fclose(fp) != 0 || rename(tmp.s, opts->progress_fn) < 0) {
+        if (!r->failed) perror(opts->progress_fn);
+        r->failed = true;
+    }
+    free(tmp.s);
+}
+
+/*
+ * Reporting thread: write a --progress report every interval, and at once
+ * on SIGUSR1, which every other thread has blocked
+ */
+static void *progress_reporter(void *arg)
+{
+    reporter_t *r = arg;
+    struct timespec ts = { r->opts->progress_interval, 0 };
+    sigset_t set;
+    bool done = false;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (!done) {
+        if (sigtimedwait(&set, NULL, &ts) < 0 && errno != EAGAIN && errno != EINTR) break;
+        done = __atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+        write_progress(r, done);
+    }
+    return NULL;
+}
+
+static reporter_t *progress_start(const opts_t *opts)
+{
+    reporter_t *r = calloc(1, sizeof(reporter_t));
+
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return NULL;
+    }
+    r->opts = opts;
+    r->start = r->t[0] = stats_now();
+    r->n = 1;
+    if (pthread_create(&r->thread, NULL, progress_reporter, r) != 0) {
+        fprintf(stderr, "Failed to start the --progress thread\n");
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/*
+ * Stop the reporting thread once the run is over, after a last report
+ */
+static void progress_stop(reporter_t *r)
+{
+    if (!r) return;
+    __atomic_store_n(&r->done, true, __ATOMIC_RELEASE);
+    pthread_kill(r->thread, SIGUSR1);
+    pthread_join(r->thread, NULL);
+    free(r);
+}
+
 /*
  * parse arguments and do things with them
  */
@@ -520,8 +3481,15 @@ int main(int argc, char *argv[])
 {
     int ret = 1;
     opts_t* opts = parse_args(argc, argv);
-    if (opts) {
-        ret = capq(opts);
+    reporter_t *reporter = NULL;
+    if (opts && (!opts->progress_fn || (reporter = progress_start(opts)))) {
+        ret = opts->manifest ? run_manifest(opts) : capq(opts);
+        progress_stop(reporter);
+        // the last of the output is only written as the files are closed
+        if (!ret && close_files(opts) < 0) ret = 1;
+        // a finished run has nothing to resume
+        if (!ret && opts->checkpoint_fn && unlink(opts->checkpoint_fn) < 0 && errno != ENOENT)
+            perror(opts->checkpoint_fn);
     }
     free_opts(opts);
     return ret;
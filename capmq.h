@@ -0,0 +1,164 @@
+/* The MIT License
+
+    Copyright (C) 2016-2017 Genome Research Ltd.
+
+    Authors: Shane McCarthy <sm15@sanger.ac.uk>
+             Jennifer Liddle <js10@sanger.ac.uk>
+             Joshua C. Randall <jcrandall@alum.mit.edu>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * libcapmq: the capmq capping rules, for use in-process.
+ *
+ * Build a rule set with capmq_rules_init() and the capmq_set_*() calls,
+ * resolve it against the header of the reads with capmq_rules_prepare(),
+ * then cap reads with capmq_apply() or capmq_apply_n(). Once prepared, a
+ * rule set is only read, so any number of threads can apply it at once.
+ */
+
+#ifndef CAPMQ_H
+#define CAPMQ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <htslib/sam.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct capmq_rules_t capmq_rules_t;
+
+// Where the last lookups got to, as reads tend to come in runs from one
+// read group and in order along a reference. Zero it before first use and
+// give each thread its own.
+typedef struct {
+    char rg[128];       // empty if nothing is cached
+    bool found;         // whether the read group has a cap
+    uint8_t capQ;
+    int tid;            // reference and segment of the last region lookup
+    size_t seg;
+    int mtid;           // the same for the mates (capmq_set_cap_mq)
+    size_t mseg;
+} capmq_cursor_t;
+
+// What needs doing to a raw BAM record (see capmq_apply_raw)
+typedef struct {
+    int newq;               // new MAPQ, or -1 if the read is unchanged
+    bool add_om;            // append om:i holding the old MAPQ
+    const uint8_t *om;      // start of an om tag to remove (restore), or NULL
+    size_t om_len;          // length of that om tag, including the tag name
+    const uint8_t *aux;     // start of the record's aux fields
+    const uint8_t *mq;      // type byte of an MQ tag to set to newmq, or NULL
+    int newmq;
+    bool add_mq;            // append mq:i holding the old MQ
+    const uint8_t *omq;     // start of an mq tag to remove (restore), or NULL
+    size_t omq_len;         // length of that mq tag, including the tag name
+} capmq_edit_t;
+
+// What capmq_apply() did to a read
+#define CAPMQ_CAPPED    1
+#define CAPMQ_RESTORED  2
+#define CAPMQ_MQ_CAPPED 4
+
+capmq_rules_t *capmq_rules_init(void);
+void capmq_rules_destroy(capmq_rules_t *r);
+// a copy of the rules as set up, which needs preparing before use
+capmq_rules_t *capmq_rules_dup(const capmq_rules_t *r);
+
+/*
+ * Setting up the rules. A read is capped at the lowest of its contig cap,
+ * its region cap and its read group cap or, if it has none, the default
+ * cap. None of these may be called once the rules are prepared.
+ */
+void capmq_set_verbose(capmq_rules_t *r, bool verbose);   // report on stderr
+void capmq_set_cap(capmq_rules_t *r, uint8_t capQ);       // default cap (255)
+void capmq_set_store(capmq_rules_t *r, bool store);       // keep the old MAPQ in om:i (true)
+void capmq_set_restore(capmq_rules_t *r, bool restore);   // put back MAPQ from om:i instead
+// also cap an integer MQ tag at the cap of the mate, found from the read
+// group and the mate's position, so that it matches the mate's new MAPQ.
+// When storing, the old MQ is kept in mq:i, which restoring puts back.
+void capmq_set_cap_mq(capmq_rules_t *r, bool cap_mq);
+int capmq_set_rg_cap(capmq_rules_t *r, const char *rg, uint8_t capQ);
+int capmq_set_contig_cap(capmq_rules_t *r, const char *contig, uint8_t capQ);
+// beg and end are 0-based, half open
+int capmq_add_region_cap(capmq_rules_t *r, const char *chrom, int64_t beg, int64_t end, uint8_t capQ);
+// raise every cap set so far below minQ to minQ
+void capmq_set_min_cap(capmq_rules_t *r, uint8_t minQ);
+
+uint8_t capmq_get_cap(const capmq_rules_t *r);
+bool capmq_get_cap_mq(const capmq_rules_t *r);
+// true if the rules would leave every read alone
+bool capmq_rules_empty(const capmq_rules_t *r);
+// the MAPQ cap for an estimated level of contamination
+uint8_t capmq_freemix2q(double freemix);
+
+/*
+ * Resolve the rules against the references of a header and fix them.
+ * Returns 0 on success, -1 on failure.
+ */
+int capmq_rules_prepare(capmq_rules_t *r, const bam_hdr_t *h);
+
+/*
+ * Cap (or restore) the mapping quality of a read. Returns CAPMQ_CAPPED
+ * and/or CAPMQ_MQ_CAPPED, CAPMQ_RESTORED, or 0 if the read was left
+ * alone, or -1 if the rules have not been prepared. capmq_apply_n()
+ * returns the number of reads changed.
+ */
+int capmq_apply(const capmq_rules_t *r, bam1_t *b);
+int capmq_apply_n(const capmq_rules_t *r, bam1_t **b, int n);
+// as capmq_apply(), keeping the lookups in a cursor from one read to the next
+int capmq_apply_cursor(const capmq_rules_t *r, capmq_cursor_t *c, bam1_t *b);
+
+/*
+ * Raw BAM records, starting at the block_size field, for streaming tools
+ * that never unpack them. capmq_apply_raw() decides the edit, returning -1
+ * if the record is malformed; there is one to make if newq >= 0 or mq is
+ * set. capmq_edit_raw() copies the record to dst (which needs room for
+ * len+14 bytes) with the edit made, returning the new length. Unless the
+ * edit adds an om or mq tag, dst may be rec itself or overlap it from
+ * below.
+ */
+int capmq_apply_raw(const capmq_rules_t *r, capmq_cursor_t *c, const uint8_t *rec, size_t len, capmq_edit_t *e);
+size_t capmq_edit_raw(uint8_t *dst, const uint8_t *rec, size_t len, const capmq_edit_t *e);
+// find a tag in raw aux data, pointing at its type byte as bam_aux_get() does
+const uint8_t *capmq_aux_find(const uint8_t *s, const uint8_t *end, const char tag[2]);
+// the value of a Z tag found that way, or NULL if it is not one
+const char *capmq_aux_str(const uint8_t *s, const uint8_t *end);
+
+/*
+ * Add a @PG line for capmq, with the given command line, after the end of
+ * each chain of programs in the header, leaving h->text up to date.
+ * Returns 0 on success, -1 on failure.
+ */
+int capmq_add_pg(bam_hdr_t *h, const char *cl);
+
+/*
+ * Find a tag in one header text line, running from line to eol. Returns a
+ * pointer to its value and sets *len, or returns NULL.
+ */
+const char *capmq_hdr_field(const char *line, const char *eol, const char tag[2], size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
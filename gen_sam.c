@@ -0,0 +1,329 @@
+/* The MIT License
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Synthetic alignment files for benchmarking capmq, and a checksum of the
+ * reads in a file for comparing the output of different runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <zlib.h>
+
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+
+// The references the reads are spread over, in proportion to their length
+static const struct { const char *name; int64_t len; } refs[] = {
+    { "chr1", 100000000 },
+    { "chr2",  80000000 },
+    { "chr3",  60000000 },
+};
+#define NREFS (sizeof(refs) / sizeof(refs[0]))
+
+// Extra aux tags, in the order they are added (-a)
+static const char *aux_tags[] = { "NM", "AS", "XS", "MD", "XA", "XB", "XC", "XD", "XE", "XF", "XG", "XH" };
+#define MAX_AUX (sizeof(aux_tags) / sizeof(aux_tags[0]))
+
+enum { MAPQ_ALIGNER, MAPQ_UNIFORM, MAPQ_FIXED };
+
+typedef struct {
+    int64_t nreads;
+    int len;            // read length
+    int nrg;            // number of read groups
+    int naux;           // extra aux tags per read
+    double unmapped;    // fraction of unplaced reads, written last
+    int qdist;          // MAPQ distribution
+    int qmin, qmax;
+    uint64_t seed;
+    htsFormat fmt;
+    char *check;        // file to checksum instead of generating (-c)
+} gen_opts_t;
+
+// xorshift64*, so that a seed gives the same reads everywhere
+static inline uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static inline int rnd_int(uint64_t *s, int n)
+{
+    return (int)((rnd(s) >> 33) % n);
+}
+
+static int mapq(const gen_opts_t *opts, uint64_t *s)
+{
+    int r;
+    switch (opts->qdist) {
+        case MAPQ_FIXED:
+            return opts->qmin;
+        case MAPQ_UNIFORM:
+            return opts->qmin + rnd_int(s, opts->qmax - opts->qmin + 1);
+        default:
+            // roughly what a short read aligner gives: mostly 60, some 0
+            r = rnd_int(s, 100);
+            return r < 75 ? 60 : r < 85 ? 0 : 1 + rnd_int(s, 59);
+    }
+}
+
+/*
+ * Append the text of one read to line
+ */
+static void format_read(const gen_opts_t *opts, uint64_t *s, int64_t n, int tid, int64_t pos, kstring_t *line)
+{
+    static const char bases[] = "ACGT";
+    int i;
+
+    if (tid >= 0)
+        ksprintf(line, "r%"PRId64"\t%d\t%s\t%"PRId64"\t%d\t%dM\t*\t0\t0\t",
+                 n, rnd_int(s, 2) ? 16 : 0, refs[tid].name, pos + 1, mapq(opts, s), opts->len);
+    else
+        ksprintf(line, "r%"PRId64"\t4\t*\t0\t0\t*\t*\t0\t0\t", n);
+
+    for (i = 0; i < opts->len; i++) kputc(bases[rnd_int(s, 4)], line);
+    kputc('\t', line);
+    for (i = 0; i < opts->len; i++) kputc(35 + rnd_int(s, 39), line);
+    ksprintf(line, "\tRG:Z:rg%d", rnd_int(s, opts->nrg));
+    for (i = 0; i < opts->naux; i++) {
+        if (i == 3) ksprintf(line, "\t%s:Z:%d", aux_tags[i], opts->len);
+        else if (i > 3 && i % 2) ksprintf(line, "\t%s:Z:chr%d,+%d,%dM,%d", aux_tags[i],
+                                          1 + rnd_int(s, NREFS), rnd_int(s, 1000000), opts->len, rnd_int(s, 5));
+        else ksprintf(line, "\t%s:i:%d", aux_tags[i], rnd_int(s, i ? opts->len : 5));
+    }
+}
+
+/*
+ * Write a coordinate sorted file of synthetic reads to stdout
+ */
+static int generate(gen_opts_t *opts)
+{
+    kstring_t text = {0, 0, NULL}, line = {0, 0, NULL};
+    bam_hdr_t *h = NULL;
+    bam1_t *b = bam_init1();
+    samFile *out;
+    uint64_t s = opts->seed ? opts->seed : 1;
+    int64_t total = 0, nmapped = opts->nreads - (int64_t)(opts->nreads * opts->unmapped), n = 0;
+    int64_t done = 0;
+    unsigned tid;
+    int i, status = 1;
+
+    char mode[5] = "w";
+    if (opts->fmt.format == bam) strcpy(mode, "wb");
+    else if (opts->fmt.format == cram) strcpy(mode, "wc");
+    if (!(out = sam_open_format("-", mode, &opts->fmt))) {
+        fprintf(stderr, "Failed to open output\n");
+        return 1;
+    }
+
+    ksprintf(&text, "@HD\tVN:1.4\tSO:coordinate\n");
+    for (tid = 0; tid < NREFS; tid++) {
+        ksprintf(&text, "@SQ\tSN:%s\tLN:%"PRId64"\n", refs[tid].name, refs[tid].len);
+        total += refs[tid].len;
+    }
+    for (i = 0; i < opts->nrg; i++) ksprintf(&text, "@RG\tID:rg%d\tSM:sample\tLB:lib%d\n", i, i);
+    if (!b || !(h = sam_hdr_parse(text.l, text.s))) {
+        fprintf(stderr, "Failed to allocate header\n");
+        goto cleanup;
+    }
+    // older htslib leaves setting the text to the caller
+    if (!h->text) {
+        h->l_text = text.l;
+        h->text = text.s;
+        text.s = NULL;
+    }
+    if (sam_hdr_write(out, h) != 0) {
+        fprintf(stderr, "Failed to write header\n");
+        goto cleanup;
+    }
+
+    // each reference gets its share of the reads, one to a slot of equal width
+    for (tid = 0; tid < NREFS; tid++) {
+        int64_t share = tid + 1 < NREFS ? nmapped * refs[tid].len / total : nmapped - done;
+        int64_t slot = share ? (refs[tid].len - opts->len) / share : 0;
+        int64_t j;
+        for (j = 0; j < share; j++) {
+            line.l = 0;
+            format_read(opts, &s, ++n, tid, j * slot + (slot > 1 ? rnd_int(&s, slot) : 0), &line);
+            if (sam_parse1(&line, h, b) < 0 || sam_write1(out, h, b) < 0) {
+                fprintf(stderr, "Failed to write read %"PRId64"\n", n);
+                goto cleanup;
+            }
+        }
+        done += share;
+    }
+    while (n < opts->nreads) {
+        line.l = 0;
+        format_read(opts, &s, ++n, -1, 0, &line);
+        if (sam_parse1(&line, h, b) < 0 || sam_write1(out, h, b) < 0) {
+            fprintf(stderr, "Failed to write read %"PRId64"\n", n);
+            goto cleanup;
+        }
+    }
+    status = 0;
+
+ cleanup:
+    if (sam_close(out) < 0) status = 1;
+    if (h) bam_hdr_destroy(h);
+    bam_destroy1(b);
+    free(text.s);
+    free(line.s);
+    return status;
+}
+
+/*
+ * Print a checksum of the reads (but not the header) in a file
+ */
+static int checksum(gen_opts_t *opts)
+{
+    samFile *in = sam_open_format(opts->check, "r", &opts->fmt);
+    kstring_t line = {0, 0, NULL};
+    bam_hdr_t *h;
+    bam1_t *b = bam_init1();
+    uLong crc = crc32(0L, Z_NULL, 0);
+    int64_t n = 0;
+    int ret;
+
+    if (!in || !(h = sam_hdr_read(in))) {
+        fprintf(stderr, "Failed to open %s\n", opts->check);
+        return 1;
+    }
+    while ((ret = sam_read1(in, h, b)) >= 0) {
+        if (sam_format1(h, b, &line) < 0) {
+            ret = -2;
+            break;
+        }
+        crc = crc32(crc, (const Bytef *)line.s, line.l);
+        n++;
+    }
+    if (ret < -1) fprintf(stderr, "Error reading %s\n", opts->check);
+    else printf("%08lx %"PRId64"\n", (unsigned long)crc, n);
+
+    free(line.s);
+    bam_destroy1(b);
+    bam_hdr_destroy(h);
+    sam_close(in);
+    return ret < -1;
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "\n");
+    fprintf(fp, "Program: gen_sam\n");
+    fprintf(fp, "About:   write coordinate sorted synthetic reads to stdout for benchmarking,\n");
+    fprintf(fp, "         or checksum the reads of a file\n");
+    fprintf(fp, "Usage:   gen_sam [options]\n");
+    fprintf(fp, "         gen_sam -c in-file\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -n N                Number of reads (default: 1000000)\n");
+    fprintf(fp, "  -l N                Read length (default: 150)\n");
+    fprintf(fp, "  -g N                Number of read groups (default: 4)\n");
+    fprintf(fp, "  -q DIST             MAPQ distribution: aligner (mostly 60, some 0),\n");
+    fprintf(fp, "                      MIN-MAX (uniform) or N (fixed) (default: aligner)\n");
+    fprintf(fp, "  -a N                Extra aux tags per read besides RG, up to %d (default: 4)\n", (int)MAX_AUX);
+    fprintf(fp, "  -u F                Fraction of unplaced reads (default: 0.01)\n");
+    fprintf(fp, "  -s N                Random seed (default: 1)\n");
+    fprintf(fp, "  -O fmt(,opt...)     Output format and format-options [SAM].\n");
+    fprintf(fp, "  -c in-file          Print a checksum and count of the reads in in-file\n");
+    fprintf(fp, "\n");
+}
+
+/*
+ * Get a whole number from min to max from the argument of an option,
+ * or die trying
+ */
+static int64_t num_from_str(int opt, const char *str, int64_t min, int64_t max)
+{
+    char *end;
+    long long v;
+
+    errno = 0;
+    v = strtoll(str, &end, 10);
+    if (end == str || *end || errno || v < min || v > max) {
+        fprintf(stderr, "Invalid -%c: %s\n", opt, str);
+        usage(stderr);
+        exit(1);
+    }
+    return v;
+}
+
+int main(int argc, char *argv[])
+{
+    gen_opts_t opts = { .nreads = 1000000, .len = 150, .nrg = 4, .naux = 4, .unmapped = 0.01, .seed = 1 };
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "n:l:g:q:a:u:s:O:c:h")) != -1) {
+    switch (opt) {
+        case 'n': opts.nreads = num_from_str(opt, optarg, 1, INT64_MAX);
+                  break;
+        case 'l': opts.len = num_from_str(opt, optarg, 1, INT_MAX);
+                  break;
+        case 'g': opts.nrg = num_from_str(opt, optarg, 1, INT_MAX);
+                  break;
+        case 'q': if (strcmp(optarg, "aligner") == 0) {
+                      opts.qdist = MAPQ_ALIGNER;
+                  } else if (sscanf(optarg, "%d-%d", &opts.qmin, &opts.qmax) == 2) {
+                      opts.qdist = MAPQ_UNIFORM;
+                  } else {
+                      opts.qdist = MAPQ_FIXED;
+                      opts.qmin = num_from_str(opt, optarg, 0, 254);
+                  }
+                  break;
+        case 'a': opts.naux = num_from_str(opt, optarg, 0, MAX_AUX);
+                  break;
+        case 'u': opts.unmapped = atof(optarg);
+                  break;
+        case 's': opts.seed = num_from_str(opt, optarg, 0, INT64_MAX);
+                  break;
+        case 'O': if (hts_parse_format(&opts.fmt, optarg) < 0) {
+                      fprintf(stderr, "Unknown format: %s\n", optarg);
+                      return 1;
+                  }
+                  break;
+        case 'c': opts.check = optarg;
+                  break;
+        case 'h': usage(stdout);
+                  return 0;
+        default:  usage(stderr);
+                  return 1;
+        }
+    }
+
+    if (opts.unmapped < 0 || opts.unmapped > 1 || opts.qmin < 0 || opts.qmin > 254 || opts.qmax > 254
+        || (opts.qdist == MAPQ_UNIFORM && opts.qmin > opts.qmax)) {
+        fprintf(stderr, "Invalid options\n");
+        usage(stderr);
+        return 1;
+    }
+
+    ret = opts.check ? checksum(&opts) : generate(&opts);
+    hts_opt_free(opts.fmt.specific);
+    return ret;
+}
@@ -0,0 +1,1096 @@
+/* The MIT License
+
+    Copyright (C) 2016-2017 Genome Research Ltd.
+
+    Authors: Shane McCarthy <sm15@sanger.ac.uk>
+             Jennifer Liddle <js10@sanger.ac.uk>
+             Joshua C. Randall <jcrandall@alum.mit.edu>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include <htslib/sam.h>
+#include <htslib/khash.h>
+#include <htslib/kstring.h>
+#include "capmq.h"
+#include "version.h"
+
+// Read Group -> Capping Quality map (also used for contigs and @PG IDs)
+KHASH_MAP_INIT_STR(rgcap, uint8_t)
+
+// An interval from capmq_add_region_cap()
+typedef struct {
+    char *chrom;
+    int64_t beg, end;   // 0-based, half open
+    uint8_t capQ;
+} bedcap_t;
+
+// A stretch of a reference with a single region cap
+typedef struct {
+    int64_t beg, end;
+    uint8_t capQ;       // the lowest cap of the intervals covering it
+} regseg_t;
+
+// The region caps for the references of a header, flattened into sorted,
+// non-overlapping segments in one array
+typedef struct {
+    regseg_t *seg;
+    size_t *off;        // reference tid has segments off[tid] to off[tid+1]-1
+    int ntid;
+    uint8_t min_capQ;
+} regcaps_t;
+
+// A rule set
+struct capmq_rules_t {
+    bool verbose;
+    uint8_t capQ;
+    bool storeQ;
+    bool restoreQ;
+    bool capMQ;         // cap the MQ tag as the mate's MAPQ is capped
+    khash_t(rgcap) *rgcaps;
+    khash_t(rgcap) *ctgcaps;    // contig caps by name
+    uint8_t *tidcaps;   // the contig caps by tid, 255 for none
+    int ntidcaps;
+    bedcap_t *bed;      // region caps
+    int nbed, mbed;
+    regcaps_t *regions; // the region caps resolved against the header
+    uint8_t min_capQ;   // lowest of all the caps; reads at or below it are left alone
+    // the capping kernels for these rules (see select_kernels), NULL until prepared
+    int (*cap_qual)(const capmq_rules_t *rules, capmq_cursor_t *cur, bam1_t *b);
+    int (*raw_cap_qual)(const capmq_rules_t *rules, capmq_cursor_t *cur, const uint8_t *rec, size_t len, capmq_edit_t *e);
+};
+
+// Set the cap for a read group; a later setting for the same group wins
+static int rgcap_put(khash_t(rgcap) *h, const char *rg, uint8_t capQ)
+{
+    int ret;
+    char *key = strdup(rg);
+    if (!key) return -1;
+    khint_t k = kh_put(rgcap, h, key, &ret);
+    if (ret < 0) {
+        free(key);
+        return -1;
+    }
+    if (ret == 0) free(key);    // already present, keep the existing key
+    kh_val(h, k) = capQ;
+    return 0;
+}
+
+static void rgcap_destroy(khash_t(rgcap) *h)
+{
+    khint_t k;
+    if (!h) return;
+    for (k = kh_begin(h); k != kh_end(h); k++)
+        if (kh_exist(h, k)) free((char *)kh_key(h, k));
+    kh_destroy(rgcap, h);
+}
+
+static void regcaps_destroy(regcaps_t *r)
+{
+    if (!r) return;
+    free(r->seg);
+    free(r->off);
+    free(r);
+}
+
+capmq_rules_t *capmq_rules_init(void)
+{
+    capmq_rules_t *rules = calloc(1, sizeof(capmq_rules_t));
+    if (!rules) return NULL;
+    rules->capQ = 255;
+    rules->storeQ = true;
+    if (!(rules->rgcaps = kh_init(rgcap)) || !(rules->ctgcaps = kh_init(rgcap))) {
+        capmq_rules_destroy(rules);
+        return NULL;
+    }
+    return rules;
+}
+
+void capmq_rules_destroy(capmq_rules_t *rules)
+{
+    int i;
+    if (!rules) return;
+    for (i = 0; i < rules->nbed; i++) free(rules->bed[i].chrom);
+    free(rules->bed);
+    regcaps_destroy(rules->regions);
+    rgcap_destroy(rules->rgcaps);
+    rgcap_destroy(rules->ctgcaps);
+    free(rules->tidcaps);
+    free(rules);
+}
+
+capmq_rules_t *capmq_rules_dup(const capmq_rules_t *rules)
+{
+    capmq_rules_t *dup = capmq_rules_init();
+    khint_t k;
+    int i;
+
+    if (!dup) return NULL;
+    dup->verbose = rules->verbose;
+    dup->capQ = rules->capQ;
+    dup->storeQ = rules->storeQ;
+    dup->restoreQ = rules->restoreQ;
+    dup->capMQ = rules->capMQ;
+    for (k = kh_begin(rules->rgcaps); k != kh_end(rules->rgcaps); k++)
+        if (kh_exist(rules->rgcaps, k) && rgcap_put(dup->rgcaps, kh_key(rules->rgcaps, k), kh_val(rules->rgcaps, k)) < 0)
+            goto fail;
+    for (k = kh_begin(rules->ctgcaps); k != kh_end(rules->ctgcaps); k++)
+        if (kh_exist(rules->ctgcaps, k) && rgcap_put(dup->ctgcaps, kh_key(rules->ctgcaps, k), kh_val(rules->ctgcaps, k)) < 0)
+            goto fail;
+    for (i = 0; i < rules->nbed; i++) {
+        const bedcap_t *b = &rules->bed[i];
+        if (capmq_add_region_cap(dup, b->chrom, b->beg, b->end, b->capQ) < 0) goto fail;
+    }
+    return dup;
+
+ fail:
+    capmq_rules_destroy(dup);
+    return NULL;
+}
+
+void capmq_set_verbose(capmq_rules_t *rules, bool verbose) { rules->verbose = verbose; }
+void capmq_set_cap(capmq_rules_t *rules, uint8_t capQ) { rules->capQ = capQ; }
+void capmq_set_store(capmq_rules_t *rules, bool store) { rules->storeQ = store; }
+void capmq_set_restore(capmq_rules_t *rules, bool restore) { rules->restoreQ = restore; }
+void capmq_set_cap_mq(capmq_rules_t *rules, bool cap_mq) { rules->capMQ = cap_mq; }
+uint8_t capmq_get_cap(const capmq_rules_t *rules) { return rules->capQ; }
+bool capmq_get_cap_mq(const capmq_rules_t *rules) { return rules->capMQ; }
+
+int capmq_set_rg_cap(capmq_rules_t *rules, const char *rg, uint8_t capQ)
+{
+    return rgcap_put(rules->rgcaps, rg, capQ);
+}
+
+int capmq_set_contig_cap(capmq_rules_t *rules, const char *contig, uint8_t capQ)
+{
+    return rgcap_put(rules->ctgcaps, contig, capQ);
+}
+
+int capmq_add_region_cap(capmq_rules_t *rules, const char *chrom, int64_t beg, int64_t end, uint8_t capQ)
+{
+    bedcap_t *b;
+
+    if (beg < 0 || end < beg) return -1;
+    if (rules->nbed == rules->mbed) {
+        int m = rules->mbed ? 2 * rules->mbed : 64;
+        bedcap_t *tmp = realloc(rules->bed, m * sizeof(bedcap_t));
+        if (!tmp) return -1;
+        rules->bed = tmp;
+        rules->mbed = m;
+    }
+    b = &rules->bed[rules->nbed];
+    if (!(b->chrom = strdup(chrom))) return -1;
+    b->beg = beg;
+    b->end = end;
+    b->capQ = capQ;
+    rules->nbed++;
+    return 0;
+}
+
+/*
+ * Raise the caps below minQ, saying so if verbose. Used with caps
+ * calculated from freemix, which can come out very low.
+ */
+void capmq_set_min_cap(capmq_rules_t *rules, uint8_t minQ)
+{
+    khint_t k;
+    int i;
+
+    if (rules->capQ < minQ) {
+        if (rules->verbose) {
+            fprintf(stderr,
+                    "Default mapping quality cap calculated from freemix (%d) "
+                    "was lower than the minimum (%d), using the latter as the "
+                    "default mapping quality cap.\n",
+                    rules->capQ, minQ);
+        }
+        rules->capQ = minQ;
+    }
+    for (k = kh_begin(rules->rgcaps); k != kh_end(rules->rgcaps); k++) {
+        if (!kh_exist(rules->rgcaps, k)) continue;
+        if (kh_val(rules->rgcaps, k) < minQ) {
+            if (rules->verbose) {
+                fprintf(stderr,
+                        "Mapping quality cap calculated from freemix (%d) "
+                        "for read group `%s' was lower than the minimum (%d), "
+                        "using the latter as the "
+                        "mapping quality cap for this read group.\n",
+                        kh_val(rules->rgcaps, k), kh_key(rules->rgcaps, k), minQ);
+            }
+            kh_val(rules->rgcaps, k) = minQ;
+        }
+    }
+    for (k = kh_begin(rules->ctgcaps); k != kh_end(rules->ctgcaps); k++) {
+        if (!kh_exist(rules->ctgcaps, k)) continue;
+        if (kh_val(rules->ctgcaps, k) < minQ) {
+            if (rules->verbose) {
+                fprintf(stderr,
+                        "Mapping quality cap calculated from freemix (%d) "
+                        "for contig `%s' was lower than the minimum (%d), "
+                        "using the latter as the "
+                        "mapping quality cap for this contig.\n",
+                        kh_val(rules->ctgcaps, k), kh_key(rules->ctgcaps, k), minQ);
+            }
+            kh_val(rules->ctgcaps, k) = minQ;
+        }
+    }
+    for (i = 0; i < rules->nbed; i++) {
+        if (rules->bed[i].capQ < minQ) {
+            if (rules->verbose) {
+                fprintf(stderr,
+                        "Mapping quality cap calculated from freemix (%d) "
+                        "for region %s:%"PRId64"-%"PRId64" was lower than the "
+                        "minimum (%d), using the latter as "
+                        "the mapping quality cap for this region.\n",
+                        rules->bed[i].capQ, rules->bed[i].chrom,
+                        rules->bed[i].beg + 1, rules->bed[i].end, minQ);
+            }
+            rules->bed[i].capQ = minQ;
+        }
+    }
+}
+
+bool capmq_rules_empty(const capmq_rules_t *rules)
+{
+    return rules->capQ == 255 && !rules->restoreQ && !kh_size(rules->rgcaps)
+           && !kh_size(rules->ctgcaps) && !rules->nbed;
+}
+
+// Convert freemix value to quality value
+uint8_t capmq_freemix2q(double f)
+{
+    double qd;
+    if (f == 0) {
+      return 0;
+    } else if (f < 0) {
+      fprintf(stderr, "cannot interpret negative freemix value %f\n", f);
+    }
+    qd = -10.0 * log10(f);
+    if (qd < 0.0) {
+      return 0;
+    }
+    if (qd > 255.0) {
+      return 255;
+    }
+    return (uint8_t) qd;
+}
+
+/*
+ * Look up the cap for a read group, going through the cur.
+ * Returns false if the read group has no cap of its own.
+ */
+static inline bool rg_cap(const capmq_rules_t *rules, capmq_cursor_t *cur, const char *rg, uint8_t *capQ)
+{
+    if (!cur->rg[0] || strcmp(cur->rg, rg) != 0) {
+        khint_t k = kh_get(rgcap, rules->rgcaps, rg);
+        cur->found = k != kh_end(rules->rgcaps);
+        if (cur->found) cur->capQ = kh_val(rules->rgcaps, k);
+        // read groups too long to cur are just looked up every time
+        if (strlen(rg) < sizeof(cur->rg)) strcpy(cur->rg, rg);
+        else cur->rg[0] = 0;
+    }
+    if (cur->found) *capQ = cur->capQ;
+    return cur->found;
+}
+
+/*
+ * Look up the region cap for a position, going through the cur. For
+ * sorted input the cursor only ever moves forward a segment or so.
+ * Returns false if no region cap covers the position.
+ */
+static inline bool region_cap(const regcaps_t *r, int *cur_tid, size_t *cur_seg, int tid, int64_t pos, uint8_t *capQ)
+{
+    size_t i = *cur_seg, lo, hi;
+
+    if (tid >= r->ntid) return false;
+    lo = r->off[tid];
+    hi = r->off[tid+1];
+    if (*cur_tid != tid || i < lo || i > hi || (i > lo && r->seg[i-1].end > pos)) {
+        // a new reference, or the reads went backwards: binary search
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (r->seg[mid].end <= pos) lo = mid + 1;
+            else hi = mid;
+        }
+        i = lo;
+        hi = r->off[tid+1];
+    } else {
+        while (i < hi && r->seg[i].end <= pos) i++;
+    }
+    *cur_tid = tid;
+    *cur_seg = i;
+    if (i < hi && r->seg[i].beg <= pos) {
+        *capQ = r->seg[i].capQ;
+        return true;
+    }
+    return false;
+}
+
+const char *capmq_hdr_field(const char *line, const char *eol, const char tag[2], size_t *len)
+{
+    const char *p = memchr(line, '\t', eol - line);
+    while (p && eol - p > 3) {
+        const char *next = memchr(p+1, '\t', eol - p - 1);
+        if (p[1] == tag[0] && p[2] == tag[1] && p[3] == ':') {
+            *len = (next ? next : eol) - (p+4);
+            return p+4;
+        }
+        p = next;
+    }
+    return NULL;
+}
+
+/*
+ * Add a @PG line for capmq to the header. As with sam_hdr_add_PG(), a line
+ * is added after the end of each existing chain of programs, linked to it
+ * with PP and given an ID not already in use. The header text is scanned
+ * and appended to directly rather than parsed and rebuilt, which matters
+ * for references with very many contigs.
+ * Returns 0 on success, -1 on failure.
+ */
+int capmq_add_pg(bam_hdr_t *h, const char *cl)
+{
+    khash_t(rgcap) *ids = kh_init(rgcap);   // values are 1 for IDs that are some PP
+    char **order = NULL;                    // IDs in the order of their lines
+    size_t norder = 0, morder = 0, i, len = h->text ? strnlen(h->text, h->l_text) : 0;
+    const char *line = h->text, *end = line + len;
+    kstring_t pg = {0, 0, NULL}, id = {0, 0, NULL};
+    char *text;
+    int ret = -1, cnt = 1, r, nends = 0;
+    khint_t k;
+
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    // a header htslib has already parsed must be kept in step with its text,
+    // which sam_hdr_add_pg() drops and sam_hdr_str() builds again
+    if (h->hrecs) {
+        kh_destroy(rgcap, ids);
+        if (sam_hdr_add_pg(h, "capmq", "VN", CAPMQ_VERSION, "CL", cl,
+                           "DS", "cap map quality values", NULL) < 0)
+            return -1;
+        return sam_hdr_str(h) ? 0 : -1;
+    }
+#endif
+
+    if (!ids) return -1;
+    for (; line < end; line++) {
+        const char *eol = memchr(line, '\n', end - line), *s;
+        size_t l;
+        if (!eol) eol = end;
+        if (eol - line > 3 && strncmp(line, "@PG\t", 4) == 0) {
+            if ((s = capmq_hdr_field(line, eol, "ID", &l))) {
+                if (norder == morder) {
+                    char **tmp = realloc(order, (morder = morder ? 2*morder : 16) * sizeof(char *));
+                    if (!tmp) goto fail;
+                    order = tmp;
+                }
+                if (!(order[norder] = strndup(s, l))) goto fail;
+                k = kh_put(rgcap, ids, order[norder], &r);
+                if (r < 0) { free(order[norder]); goto fail; }
+                if (r == 0) free(order[norder]);    // duplicate ID
+                else { kh_val(ids, k) = 0; norder++; }
+            }
+        }
+        line = eol;
+    }
+
+    // second pass, as PP may refer forward
+    for (line = h->text; line < end; line++) {
+        const char *eol = memchr(line, '\n', end - line), *s;
+        size_t l;
+        if (!eol) eol = end;
+        if (eol - line > 3 && strncmp(line, "@PG\t", 4) == 0 && (s = capmq_hdr_field(line, eol, "PP", &l))) {
+            if (!(id.s = strndup(s, l))) goto fail;
+            if ((k = kh_get(rgcap, ids, id.s)) != kh_end(ids)) kh_val(ids, k) = 1;
+            free(id.s);
+            id.s = NULL;
+        }
+        line = eol;
+    }
+
+    // one line after each chain end, or a single unlinked one if there are none
+    for (i = 0; i <= norder; i++) {
+        if (i < norder && kh_val(ids, kh_get(rgcap, ids, order[i]))) continue;
+        if (i == norder && nends) break;
+        id.l = 0;
+        if (kputs("capmq", &id) < 0) goto fail;
+        while (kh_get(rgcap, ids, id.s) != kh_end(ids)) {
+            id.l = 0;
+            if (ksprintf(&id, "capmq.%d", cnt++) < 0) goto fail;
+        }
+        if (ksprintf(&pg, "@PG\tID:%s\tPN:capmq", id.s) < 0
+            || (i < norder && ksprintf(&pg, "\tPP:%s", order[i]) < 0)
+            || ksprintf(&pg, "\tVN:%s\tCL:%s\tDS:cap map quality values\n", CAPMQ_VERSION, cl) < 0)
+            goto fail;
+        // later lines must not reuse this ID
+        if (i < norder) {
+            char *new_id = ks_release(&id);
+            k = kh_put(rgcap, ids, new_id, &r);
+            if (r <= 0) { free(new_id); goto fail; }
+            kh_val(ids, k) = 0;
+        }
+        nends++;
+    }
+
+    text = realloc(h->text, len + 1 + pg.l + 1);
+    if (!text) goto fail;
+    if (len && text[len-1] != '\n') text[len++] = '\n';
+    memcpy(text + len, pg.s, pg.l + 1);
+    h->text = text;
+    h->l_text = len + pg.l;
+    ret = 0;
+
+ fail:
+    // order[] holds the keys of ids, which rgcap_destroy() frees
+    free(order);
+    rgcap_destroy(ids);
+    free(id.s);
+    free(pg.s);
+    return ret;
+}
+
+// A region cap starting (+1) or ending (-1), for flattening the intervals
+typedef struct {
+    int tid;
+    int64_t pos;
+    int delta;
+    uint8_t capQ;
+} regevent_t;
+
+static int regevent_cmp(const void *av, const void *bv)
+{
+    const regevent_t *a = av, *b = bv;
+    if (a->tid != b->tid) return a->tid < b->tid ? -1 : 1;
+    if (a->pos != b->pos) return a->pos < b->pos ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Resolve the region caps against the references of the header and
+ * flatten them, so that each stretch of a reference has a single segment
+ * holding the lowest cap of the intervals covering it.
+ */
+static regcaps_t *regions_init(const capmq_rules_t *rules, const bam_hdr_t *h)
+{
+    regcaps_t *r = calloc(1, sizeof(regcaps_t));
+    regevent_t *ev = malloc((2 * (size_t)rules->nbed + 1) * sizeof(regevent_t));
+    size_t nev = 0, nseg = 0, e;
+    int active[256] = {0};
+    int i, tid;
+
+    if (!r || !ev || !(r->off = calloc(h->n_targets + 1, sizeof(size_t)))
+        || !(r->seg = malloc((2 * (size_t)rules->nbed + 1) * sizeof(regseg_t)))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(ev);
+        regcaps_destroy(r);
+        return NULL;
+    }
+    r->ntid = h->n_targets;
+    r->min_capQ = 255;
+
+    for (i = 0; i < rules->nbed; i++) {
+        const bedcap_t *b = &rules->bed[i];
+        if (b->beg == b->end) continue;
+        if ((tid = bam_name2id((bam_hdr_t *)h, b->chrom)) < 0) {
+            if (rules->verbose) fprintf(stderr, "No @SQ header line for region cap on %s\n", b->chrom);
+            continue;
+        }
+        ev[nev++] = (regevent_t){ tid, b->beg, 1, b->capQ };
+        ev[nev++] = (regevent_t){ tid, b->end, -1, b->capQ };
+        if (b->capQ < r->min_capQ) r->min_capQ = b->capQ;
+    }
+    qsort(ev, nev, sizeof(regevent_t), regevent_cmp);
+
+    // sweep each reference, counting the intervals open at each cap value
+    for (e = 0, tid = 0; e < nev; ) {
+        int64_t pos = ev[e].pos;
+        int t = ev[e].tid, q;
+        // references with no caps before this one get no segments
+        for (; tid <= t; tid++) r->off[tid] = nseg;
+        while (e < nev && ev[e].tid == t && ev[e].pos == pos) {
+            active[ev[e].capQ] += ev[e].delta;
+            e++;
+        }
+        for (q = 0; q < 256 && !active[q]; q++);
+        if (q < 256 && e < nev && ev[e].tid == t) {
+            // merge with the previous segment if it carries on at the same cap
+            if (nseg > r->off[t] && r->seg[nseg-1].end == pos && r->seg[nseg-1].capQ == q)
+                r->seg[nseg-1].end = ev[e].pos;
+            else
+                r->seg[nseg++] = (regseg_t){ pos, ev[e].pos, q };
+        }
+    }
+    for (; tid <= r->ntid; tid++) r->off[tid] = nseg;
+    free(ev);
+    return r;
+}
+
+/*
+ * Look up the contig caps in the header, giving a cap for each tid
+ */
+static int contig_caps_init(capmq_rules_t *rules, const bam_hdr_t *h)
+{
+    khint_t k;
+    int tid;
+
+    if (!(rules->tidcaps = malloc(h->n_targets ? h->n_targets : 1))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+    memset(rules->tidcaps, 255, h->n_targets);
+    rules->ntidcaps = h->n_targets;
+    for (k = kh_begin(rules->ctgcaps); k != kh_end(rules->ctgcaps); k++) {
+        if (!kh_exist(rules->ctgcaps, k)) continue;
+        if ((tid = bam_name2id((bam_hdr_t *)h, kh_key(rules->ctgcaps, k))) < 0) {
+            if (rules->verbose) fprintf(stderr, "No @SQ header line for contig %s\n", kh_key(rules->ctgcaps, k));
+            continue;
+        }
+        rules->tidcaps[tid] = kh_val(rules->ctgcaps, k);
+    }
+    return 0;
+}
+
+/*
+ * Check the read group caps against the @RG lines of the header,
+ * reporting any that match no read group in the file
+ */
+static void check_rg_caps(const capmq_rules_t *rules, const bam_hdr_t *h)
+{
+    khash_t(rgcap) *seen = kh_init(rgcap);
+    const char *line = h->text, *end = h->text + h->l_text;
+    khint_t k;
+    int ret;
+
+    if (!seen) return;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        if (eol - line > 3 && strncmp(line, "@RG\t", 4) == 0) {
+            size_t len;
+            const char *id = capmq_hdr_field(line, eol, "ID", &len);
+            if (id) {
+                char *rg = strndup(id, len);
+                if (rg) {
+                    k = kh_get(rgcap, rules->rgcaps, rg);
+                    if (k != kh_end(rules->rgcaps)) kh_put(rgcap, seen, kh_key(rules->rgcaps, k), &ret);
+                    free(rg);
+                }
+            }
+        }
+        line = eol + 1;
+    }
+    for (k = kh_begin(rules->rgcaps); k != kh_end(rules->rgcaps); k++) {
+        if (kh_exist(rules->rgcaps, k) && kh_get(rgcap, seen, kh_key(rules->rgcaps, k)) == kh_end(seen))
+            fprintf(stderr, "No @RG header line for read group %s\n", kh_key(rules->rgcaps, k));
+    }
+    kh_destroy(rgcap, seen);
+}
+
+/*
+ * Skip over one aux field, given a pointer to its type byte.
+ * Returns a pointer to the next tag, or NULL if the field runs past end.
+ */
+static const uint8_t *aux_skip(const uint8_t *s, const uint8_t *end)
+{
+    uint32_t n;
+    int size;
+
+    if (s >= end) return NULL;
+    switch (*s++) {
+        case 'A': case 'c': case 'C': size = 1; break;
+        case 's': case 'S': size = 2; break;
+        case 'i': case 'I': case 'f': size = 4; break;
+        case 'd': size = 8; break;
+        case 'Z': case 'H':
+            while (s < end && *s) s++;
+            return s < end ? s+1 : NULL;
+        case 'B':
+            if (end - s < 5) return NULL;
+            switch (*s) {
+                case 'c': case 'C': size = 1; break;
+                case 's': case 'S': size = 2; break;
+                case 'i': case 'I': case 'f': size = 4; break;
+                default: return NULL;
+            }
+            memcpy(&n, s+1, 4);
+            s += 5;
+            if ((uint64_t)n * size > (uint64_t)(end - s)) return NULL;
+            return s + (size_t)n * size;
+        default: return NULL;
+    }
+    return end - s >= size ? s + size : NULL;
+}
+
+/*
+ * Find a tag in a raw aux block. As with bam_aux_get(), the result points
+ * at the type byte, so bam_aux2i() and friends can be used on it.
+ */
+static const uint8_t *aux_find(const uint8_t *s, const uint8_t *end, const char tag[2])
+{
+    while (s && end - s >= 3) {
+        if (s[0] == tag[0] && s[1] == tag[1]) return s+2;
+        s = aux_skip(s+2, end);
+    }
+    return NULL;
+}
+
+/*
+ * Find two aux tags in a single pass over the aux fields
+ */
+static inline void aux_find2(const uint8_t *s, const uint8_t *end, const char tag1[2], const uint8_t **p1,
+                             const char tag2[2], const uint8_t **p2)
+{
+    *p1 = *p2 = NULL;
+    while (s && end - s >= 3 && !(*p1 && *p2)) {
+        if (s[0] == tag1[0] && s[1] == tag1[1] && !*p1) *p1 = s+2;
+        else if (s[0] == tag2[0] && s[1] == tag2[1] && !*p2) *p2 = s+2;
+        s = aux_skip(s+2, end);
+    }
+}
+
+const uint8_t *capmq_aux_find(const uint8_t *s, const uint8_t *end, const char tag[2])
+{
+    return aux_find(s, end, tag);
+}
+
+const char *capmq_aux_str(const uint8_t *s, const uint8_t *end)
+{
+    return s && *s == 'Z' && aux_skip(s, end) ? (const char *)s+1 : NULL;
+}
+
+// Kernel modes, fixed once the rules are prepared
+#define KERNEL_RESTORE  1   // restore from om (and MQ from mq)
+#define KERNEL_STORE    2   // keep the old MAPQ in om (and MQ in mq)
+#define KERNEL_RG       4   // read group caps
+#define KERNEL_REGION   8   // region caps
+#define KERNEL_CONTIG   16  // contig caps
+#define KERNEL_MATE     32  // cap MQ as well
+
+/*
+ * The capping decision for one placed read, shared by the bam1_t and the
+ * raw BAM record paths. Returns the new MAPQ, or -1 to leave the read
+ * alone, and sets *om to the om tag where that is needed: the tag to
+ * restore from, or (when storing) an existing tag that must not be
+ * duplicated.
+ *
+ * mode is a compile time constant in each caller, so every combination of
+ * options gets its own copy with the unused branches and aux lookups gone.
+ */
+static inline __attribute__((always_inline))
+int cap_kernel(const capmq_rules_t *rules, capmq_cursor_t *cur, const int mode, int tid, int64_t pos,
+               uint8_t qual, const uint8_t *aux, const uint8_t *end, const uint8_t **om)
+{
+    const uint8_t *rg = NULL;
+    uint8_t capQ = rules->capQ;
+
+    *om = NULL;
+    // the restore option overrides everything else
+    if (mode & KERNEL_RESTORE) {
+        *om = aux_find(aux, end, "om");
+        return *om ? (uint8_t)bam_aux2i(*om) : -1;
+    }
+
+    // most reads are under every cap and need no aux lookups at all
+    if (qual <= rules->min_capQ) return -1;
+
+    if (mode & KERNEL_RG) {
+        if (mode & KERNEL_STORE) aux_find2(aux, end, "RG", &rg, "om", om);
+        else rg = aux_find(aux, end, "RG");
+        if (rg && *rg == 'Z' && aux_skip(rg, end)) rg_cap(rules, cur, (const char *)rg+1, &capQ);
+    }
+    // contig and region caps can only lower the cap
+    if ((mode & KERNEL_CONTIG) && tid < rules->ntidcaps && rules->tidcaps[tid] < capQ) capQ = rules->tidcaps[tid];
+    if (mode & KERNEL_REGION) {
+        uint8_t regQ;
+        if (region_cap(rules->regions, &cur->tid, &cur->seg, tid, pos, &regQ) && regQ < capQ) capQ = regQ;
+    }
+    if (qual <= capQ) return -1;
+
+    if ((mode & KERNEL_STORE) && !(mode & KERNEL_RG)) *om = aux_find(aux, end, "om");
+    return capQ;
+}
+
+/*
+ * The capping decision for the mate of a read, to cap its MQ tag. Mates
+ * share a read group, and the mate's contig and start are in the read, so
+ * the mate's cap is known without seeing it. Returns the new MQ, or -1 to
+ * leave it alone, and sets *mq to the tag and (when storing) *omq to an
+ * existing mq tag that must not be duplicated.
+ */
+static inline __attribute__((always_inline))
+int mate_kernel(const capmq_rules_t *rules, capmq_cursor_t *cur, const int mode, int mtid, int64_t mpos,
+                const uint8_t *aux, const uint8_t *end, const uint8_t **mq, const uint8_t **omq)
+{
+    const uint8_t *rg = NULL;
+    uint8_t capQ = rules->capQ;
+    int64_t q;
+
+    *mq = *omq = NULL;
+    // unplaced reads are never capped
+    if (mtid < 0) return -1;
+    if (mode & KERNEL_RG) aux_find2(aux, end, "MQ", mq, "RG", &rg);
+    else *mq = aux_find(aux, end, "MQ");
+    // only an integer tag can be lowered in place
+    if (!*mq || !memchr("cCsSiI", **mq, 6) || !aux_skip(*mq, end)) return -1;
+    if ((q = bam_aux2i(*mq)) <= rules->min_capQ) return -1;
+
+    if (rg && *rg == 'Z' && aux_skip(rg, end)) rg_cap(rules, cur, (const char *)rg+1, &capQ);
+    if ((mode & KERNEL_CONTIG) && mtid < rules->ntidcaps && rules->tidcaps[mtid] < capQ) capQ = rules->tidcaps[mtid];
+    if (mode & KERNEL_REGION) {
+        uint8_t regQ;
+        if (region_cap(rules->regions, &cur->mtid, &cur->mseg, mtid, mpos, &regQ) && regQ < capQ) capQ = regQ;
+    }
+    if (q <= capQ) return -1;
+
+    if (mode & KERNEL_STORE) *omq = aux_find(aux, end, "mq");
+    return capQ;
+}
+
+// Whether an integer aux value fits the tag's type
+static inline bool aux_int_fits(uint8_t type, int64_t v)
+{
+    switch (type) {
+        case 'c': return v >= INT8_MIN && v <= INT8_MAX;
+        case 'C': return v >= 0 && v <= UINT8_MAX;
+        case 's': return v >= INT16_MIN && v <= INT16_MAX;
+        case 'S': return v >= 0 && v <= UINT16_MAX;
+        case 'i': return v >= INT32_MIN && v <= INT32_MAX;
+        default:  return v >= 0 && v <= UINT32_MAX;
+    }
+}
+
+/*
+ * The MQ to put back from an mq tag when restoring. Returns it, or -1 if
+ * there is none or it does not fit the MQ tag, and sets *mq and *omq to
+ * the two tags.
+ */
+static inline int mate_restore_kernel(const uint8_t *aux, const uint8_t *end, const uint8_t **mq, const uint8_t **omq)
+{
+    int64_t q;
+
+    aux_find2(aux, end, "MQ", mq, "mq", omq);
+    if (!*mq || !*omq || !memchr("cCsSiI", **mq, 6) || !aux_skip(*mq, end)
+        || !memchr("cCsSiI", **omq, 6) || !aux_skip(*omq, end))
+        return -1;
+    q = bam_aux2i(*omq);
+    return aux_int_fits(**mq, q) ? q : -1;
+}
+
+// Overwrite an integer aux value in place; it must fit the tag's type
+static inline void aux_set_int(uint8_t *s, int v)
+{
+    switch (*s) {
+        case 'c': case 'C': s[1] = v; break;
+        case 's': case 'S': { uint16_t x = v; memcpy(s+1, &x, 2); break; }
+        default: { uint32_t x = v; memcpy(s+1, &x, 4); break; }
+    }
+}
+
+/*
+ * Remove the tag whose type byte is at s, as bam_aux_del() does. The om
+ * tags capmq appends are normally last, when only the length changes.
+ */
+static inline void aux_remove(bam1_t *b, uint8_t *s)
+{
+    uint8_t *end = b->data + b->l_data;
+    const uint8_t *next = aux_skip(s, end);
+
+    if (!next) {
+        bam_aux_del(b, s);
+        return;
+    }
+    if (next < end) memmove(s-2, next, end - next);
+    b->l_data -= next - (s-2);
+}
+
+/*
+ * Cap (or restore) the mapping quality of a single read
+ */
+static inline __attribute__((always_inline))
+int cap_qual_mode(const capmq_rules_t *rules, capmq_cursor_t *cur, bam1_t *b, const int mode)
+{
+    const uint8_t *om, *mq, *omq;
+    int newq, ret = 0;
+
+    if (b->core.tid >= 0 && (newq = cap_kernel(rules, cur, mode, b->core.tid, b->core.pos, b->core.qual,
+                                               bam_get_aux(b), b->data + b->l_data, &om)) >= 0) {
+        if (mode & KERNEL_RESTORE) {
+            aux_remove(b, (uint8_t *)om);   // delete om tag
+            ret = CAPMQ_RESTORED;
+        } else {
+            if ((mode & KERNEL_STORE) && !om) {
+                // handle -s option
+                int q = b->core.qual;
+                bam_aux_append(b, "om", 'i', 4, (uint8_t*)&q);
+            }
+            ret = CAPMQ_CAPPED;
+        }
+        b->core.qual = newq;
+    }
+    // after any om tag is added or removed, which may move the aux data
+    if ((mode & KERNEL_RESTORE) && (newq = mate_restore_kernel(bam_get_aux(b), b->data + b->l_data, &mq, &omq)) >= 0) {
+        aux_set_int((uint8_t *)mq, newq);
+        aux_remove(b, (uint8_t *)omq);
+        ret = CAPMQ_RESTORED;
+    }
+    if ((mode & KERNEL_MATE) && (newq = mate_kernel(rules, cur, mode, b->core.mtid, b->core.mpos,
+                                                    bam_get_aux(b), b->data + b->l_data, &mq, &omq)) >= 0) {
+        int32_t oldmq = bam_aux2i(mq);
+        aux_set_int((uint8_t *)mq, newq);
+        if ((mode & KERNEL_STORE) && !omq) bam_aux_append(b, "mq", 'i', 4, (uint8_t *)&oldmq);
+        ret |= CAPMQ_MQ_CAPPED;
+    }
+    return ret;
+}
+
+/*
+ * Decide how to cap (or restore) a raw BAM record, starting at its
+ * block_size field, without unpacking it. Mirrors cap_qual_mode().
+ * Returns -1 if the record is malformed.
+ */
+static inline __attribute__((always_inline))
+int raw_cap_qual_mode(const capmq_rules_t *rules, capmq_cursor_t *cur, const uint8_t *rec, size_t len, capmq_edit_t *e, const int mode)
+{
+    const uint8_t *aux, *end = rec + len, *om, *omq;
+    int32_t tid, pos, mtid, mpos, l_seq;
+    uint16_t n_cigar;
+    int newq;
+
+    e->newq = -1;
+    e->add_om = false;
+    e->om = NULL;
+    e->om_len = 0;
+    e->mq = NULL;
+    e->newmq = -1;
+    e->add_mq = false;
+    e->omq = NULL;
+    e->omq_len = 0;
+
+    if (len < 36) return -1;
+    memcpy(&tid, rec+4, 4);
+    memcpy(&pos, rec+8, 4);
+    memcpy(&n_cigar, rec+16, 2);
+    memcpy(&l_seq, rec+20, 4);
+    if (l_seq < 0) return -1;
+    aux = rec + 36 + rec[12] + 4*(size_t)n_cigar + ((size_t)l_seq+1)/2 + l_seq;
+    if (aux > end) return -1;
+    e->aux = aux;
+
+    if (tid >= 0 && (newq = cap_kernel(rules, cur, mode, tid, pos, rec[13], aux, end, &om)) >= 0) {
+        if (mode & KERNEL_RESTORE) {
+            const uint8_t *next = aux_skip(om, end);
+            if (!next) return -1;
+            e->om = om-2;
+            e->om_len = next - (om-2);
+        } else {
+            e->add_om = (mode & KERNEL_STORE) && !om;
+        }
+        e->newq = newq;
+    }
+    if (mode & KERNEL_RESTORE) {
+        if ((e->newmq = mate_restore_kernel(aux, end, &om, &omq)) >= 0) {
+            e->mq = om;
+            e->omq = omq-2;
+            e->omq_len = aux_skip(omq, end) - e->omq;
+        }
+    }
+    if (mode & KERNEL_MATE) {
+        memcpy(&mtid, rec+24, 4);
+        memcpy(&mpos, rec+28, 4);
+        if ((e->newmq = mate_kernel(rules, cur, mode, mtid, mpos, aux, end, &om, &omq)) >= 0) {
+            e->mq = om;
+            e->add_mq = (mode & KERNEL_STORE) && !omq;
+        }
+    }
+    return 0;
+}
+
+// One copy of each path for every combination of rules, named by mode
+#define CAP_KERNEL(mode)                                                        \
+static int cap_qual_##mode(const capmq_rules_t *rules, capmq_cursor_t *cur,     \
+                           bam1_t *b)                                           \
+{                                                                               \
+    return cap_qual_mode(rules, cur, b, mode);                                  \
+}                                                                               \
+static int raw_cap_qual_##mode(const capmq_rules_t *rules, capmq_cursor_t *cur, \
+                               const uint8_t *rec, size_t len, capmq_edit_t *e) \
+{                                                                               \
+    return raw_cap_qual_mode(rules, cur, rec, len, e, mode);                    \
+}
+
+CAP_KERNEL(1)   // KERNEL_RESTORE, which ignores everything else
+CAP_KERNEL(0)  CAP_KERNEL(2)  CAP_KERNEL(4)  CAP_KERNEL(6)
+CAP_KERNEL(8)  CAP_KERNEL(10) CAP_KERNEL(12) CAP_KERNEL(14)
+CAP_KERNEL(16) CAP_KERNEL(18) CAP_KERNEL(20) CAP_KERNEL(22)
+CAP_KERNEL(24) CAP_KERNEL(26) CAP_KERNEL(28) CAP_KERNEL(30)
+CAP_KERNEL(32) CAP_KERNEL(34) CAP_KERNEL(36) CAP_KERNEL(38)
+CAP_KERNEL(40) CAP_KERNEL(42) CAP_KERNEL(44) CAP_KERNEL(46)
+CAP_KERNEL(48) CAP_KERNEL(50) CAP_KERNEL(52) CAP_KERNEL(54)
+CAP_KERNEL(56) CAP_KERNEL(58) CAP_KERNEL(60) CAP_KERNEL(62)
+
+#define KERNEL_ENTRY(mode) [mode] = { cap_qual_##mode, raw_cap_qual_##mode }
+
+// The kernels, by mode
+static const struct {
+    int (*cap_qual)(const capmq_rules_t *rules, capmq_cursor_t *cur, bam1_t *b);
+    int (*raw_cap_qual)(const capmq_rules_t *rules, capmq_cursor_t *cur, const uint8_t *rec, size_t len, capmq_edit_t *e);
+} kernels[] = {
+    KERNEL_ENTRY(1),
+    KERNEL_ENTRY(0),  KERNEL_ENTRY(2),  KERNEL_ENTRY(4),  KERNEL_ENTRY(6),
+    KERNEL_ENTRY(8),  KERNEL_ENTRY(10), KERNEL_ENTRY(12), KERNEL_ENTRY(14),
+    KERNEL_ENTRY(16), KERNEL_ENTRY(18), KERNEL_ENTRY(20), KERNEL_ENTRY(22),
+    KERNEL_ENTRY(24), KERNEL_ENTRY(26), KERNEL_ENTRY(28), KERNEL_ENTRY(30),
+    KERNEL_ENTRY(32), KERNEL_ENTRY(34), KERNEL_ENTRY(36), KERNEL_ENTRY(38),
+    KERNEL_ENTRY(40), KERNEL_ENTRY(42), KERNEL_ENTRY(44), KERNEL_ENTRY(46),
+    KERNEL_ENTRY(48), KERNEL_ENTRY(50), KERNEL_ENTRY(52), KERNEL_ENTRY(54),
+    KERNEL_ENTRY(56), KERNEL_ENTRY(58), KERNEL_ENTRY(60), KERNEL_ENTRY(62),
+};
+
+/*
+ * Pick the kernels for the rules in effect, once they are prepared
+ */
+static void select_kernels(capmq_rules_t *rules)
+{
+    khint_t k;
+    int mode;
+
+    rules->min_capQ = rules->capQ;
+    for (k = kh_begin(rules->rgcaps); k != kh_end(rules->rgcaps); k++)
+        if (kh_exist(rules->rgcaps, k) && kh_val(rules->rgcaps, k) < rules->min_capQ)
+            rules->min_capQ = kh_val(rules->rgcaps, k);
+    for (k = kh_begin(rules->ctgcaps); k != kh_end(rules->ctgcaps); k++)
+        if (kh_exist(rules->ctgcaps, k) && kh_val(rules->ctgcaps, k) < rules->min_capQ)
+            rules->min_capQ = kh_val(rules->ctgcaps, k);
+    if (rules->regions && rules->regions->min_capQ < rules->min_capQ)
+        rules->min_capQ = rules->regions->min_capQ;
+
+    if (rules->restoreQ) {
+        mode = KERNEL_RESTORE;
+    } else {
+        mode = (rules->storeQ ? KERNEL_STORE : 0)
+             | (kh_size(rules->rgcaps) ? KERNEL_RG : 0)
+             | (rules->regions ? KERNEL_REGION : 0)
+             | (rules->tidcaps ? KERNEL_CONTIG : 0)
+             | (rules->capMQ ? KERNEL_MATE : 0);
+    }
+    rules->cap_qual = kernels[mode].cap_qual;
+    rules->raw_cap_qual = kernels[mode].raw_cap_qual;
+}
+
+int capmq_rules_prepare(capmq_rules_t *rules, const bam_hdr_t *h)
+{
+    khint_t k;
+
+    // a rule set can be prepared again for another header
+    free(rules->tidcaps);
+    rules->tidcaps = NULL;
+    rules->ntidcaps = 0;
+    regcaps_destroy(rules->regions);
+    rules->regions = NULL;
+
+    if (rules->verbose) {
+        for (k = kh_begin(rules->rgcaps); k != kh_end(rules->rgcaps); k++) {
+            if (kh_exist(rules->rgcaps, k))
+                fprintf(stderr, "Capping mapping qualities to a maximum of %d for read group %s\n", kh_val(rules->rgcaps, k), kh_key(rules->rgcaps, k));
+        }
+        for (k = kh_begin(rules->ctgcaps); k != kh_end(rules->ctgcaps); k++) {
+            if (kh_exist(rules->ctgcaps, k))
+                fprintf(stderr, "Capping mapping qualities to a maximum of %d on contig %s\n", kh_val(rules->ctgcaps, k), kh_key(rules->ctgcaps, k));
+        }
+        check_rg_caps(rules, h);
+    }
+    if (kh_size(rules->ctgcaps) && contig_caps_init(rules, h) < 0) return -1;
+    if (rules->nbed && !(rules->regions = regions_init(rules, h))) return -1;
+    select_kernels(rules);
+    return 0;
+}
+
+int capmq_apply_cursor(const capmq_rules_t *rules, capmq_cursor_t *cur, bam1_t *b)
+{
+    return rules->cap_qual ? rules->cap_qual(rules, cur, b) : -1;
+}
+
+int capmq_apply(const capmq_rules_t *rules, bam1_t *b)
+{
+    capmq_cursor_t cur = {{0}};
+    return capmq_apply_cursor(rules, &cur, b);
+}
+
+int capmq_apply_n(const capmq_rules_t *rules, bam1_t **b, int n)
+{
+    capmq_cursor_t cur = {{0}};
+    int i, changed = 0;
+
+    if (!rules->cap_qual) return -1;
+    for (i = 0; i < n; i++)
+        if (rules->cap_qual(rules, &cur, b[i])) changed++;
+    return changed;
+}
+
+int capmq_apply_raw(const capmq_rules_t *rules, capmq_cursor_t *cur, const uint8_t *rec, size_t len, capmq_edit_t *e)
+{
+    return rules->raw_cap_qual ? rules->raw_cap_qual(rules, cur, rec, len, e) : -1;
+}
+
+size_t capmq_edit_raw(uint8_t *dst, const uint8_t *rec, size_t len, const capmq_edit_t *e)
+{
+    // the tags to cut out, in order
+    const uint8_t *cut[2] = { e->om, e->omq };
+    size_t cut_len[2] = { e->om_len, e->omq_len };
+    int32_t oldq = rec[13], oldmq = e->add_mq ? bam_aux2i(e->mq) : 0;
+    size_t n = 0, from = 0, mq_off = e->mq ? e->mq - rec : 0;
+    uint32_t block_size;
+    int i;
+
+    if (!cut[0] || (cut[1] && cut[1] < cut[0])) {
+        cut[0] = e->omq; cut_len[0] = e->omq_len;
+        cut[1] = e->om; cut_len[1] = e->om_len;
+    }
+    // dst may overlap rec if the record does not grow, and edits in place
+    // if it is rec, so a tag at the end is dropped without copying
+    for (i = 0; i < 2 && cut[i]; i++) {
+        size_t at = cut[i] - rec;
+        if (dst + n != rec + from) memmove(dst + n, rec + from, at - from);
+        n += at - from;
+        from = at + cut_len[i];
+        if (cut[i] < e->mq) mq_off -= cut_len[i];
+    }
+    if (dst + n != rec + from) memmove(dst + n, rec + from, len - from);
+    n += len - from;
+    if (e->add_om) {
+        dst[n] = 'o'; dst[n+1] = 'm'; dst[n+2] = 'i';
+        memcpy(dst+n+3, &oldq, 4);
+        n += 7;
+    }
+    if (e->add_mq) {
+        dst[n] = 'm'; dst[n+1] = 'q'; dst[n+2] = 'i';
+        memcpy(dst+n+3, &oldmq, 4);
+        n += 7;
+    }
+    if (e->mq) aux_set_int(dst + mq_off, e->newmq);
+    if (e->newq >= 0) dst[13] = e->newq;
+    block_size = n - 4;
+    memcpy(dst, &block_size, 4);
+    return n;
+}
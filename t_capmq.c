@@ -166,6 +166,101 @@ int main(int argc, char *argv[])
     // read groups from file - RG `a' not matched
     if (run_test("./capmq -m41 -S -f -G test-b-ai.txt test1.sam","6 1 om[-1,-1,-1,-1,-1,-1] q[45,46,43,43,4,4]",0,&sam_content_test)) fail++; else pass++;
 
+    // cap all values using a shared thread pool
+    if (run_test("./capmq -@2 -C40 test1.sam","6 1 om[45,46,47,48,-1,-1] q[40,40,40,40,4,4]",0,&sam_content_test)) fail++; else pass++;
+
+    // cap in batches on a pipeline, then restore
+    if (run_test("./capmq --pipeline --batch-size 4 -@2 -C40 test1.sam","6 1 om[45,46,47,48,-1,-1] q[40,40,40,40,4,4]",0,&sam_content_test)) fail++; else pass++;
+    if (run_test("./capmq --pipeline --batch-size 1 -C40 test1.sam | ./capmq --pipeline -r","6 2 om[-1,-1,-1,-1,-1,-1] q[45,46,47,48,4,4]",0,&sam_content_test)) fail++; else pass++;
+
+    // BAM to BAM, copying unchanged blocks
+    if (run_test("./capmq -C100 -O bam test1.sam | ./capmq --block-passthrough -C40 -O bam - | ./capmq -C100","6 3 om[45,46,47,48,-1,-1] q[40,40,40,40,4,4]",0,&sam_content_test)) fail++; else pass++;
+
+    // BAM to BAM patching raw records, then restore
+    if (run_test("./capmq -C40 -O bam test1.sam | ./capmq -C30 -O bam - | ./capmq -r -O bam - | ./capmq -C100","6 4 om[-1,-1,-1,-1,-1,-1] q[45,46,47,48,4,4]",0,&sam_content_test)) fail++; else pass++;
+
+    // index the output as it is written, then cap it region by region
+    if (run_test("./capmq -C100 -O bam --write-index test2.sam t_capmq.tmp.bam && ./capmq --by-region --region-size 50 -@2 -C40 t_capmq.tmp.bam; s=$?; rm -f t_capmq.tmp.bam*; exit $s","6 2 om[45,46,47,48,50,-1] q[40,40,40,40,40,0]",0,&sam_content_test)) fail++; else pass++;
+
+    // count the reads capped for the statistics report
+    if (run_test("./capmq -C40 --stats t_capmq.tmp.json test1.sam > /dev/null && cat t_capmq.tmp.json; s=$?; rm -f t_capmq.tmp.json; exit $s","\"total\": {\"reads\": 6, \"mapped\": 6, \"capped\": 4, \"restored\": 0}",0,&content_contains_test)) fail++; else pass++;
+
+    // write SAM to stdout and BAM to a file from one pass
+    if (run_test("./capmq -C40 -o t_capmq.tmp.bam test1.sam - > /dev/null && ./capmq -C100 t_capmq.tmp.bam; s=$?; rm -f t_capmq.tmp.bam; exit $s","6 2 om[45,46,47,48,-1,-1] q[40,40,40,40,4,4]",0,&sam_content_test)) fail++; else pass++;
+
+    // a file per read group, reopening them to append with only one open at a time
+    if (run_test("./capmq -C40 --split-rg t_capmq.tmp.%r.bam --split-max-open 1 test2.sam > /dev/null && ./capmq -C100 t_capmq.tmp.b.bam | grep -v '^@' | cut -f1,5 | tr '\\t\\n' ':,'; s=$?; rm -f t_capmq.tmp.*.bam; exit $s","r2:40,r2:40,r4:0,",0,&content_contains_test)) fail++; else pass++;
+
+    // region caps from a BED file, the lowest of overlapping intervals applying
+    if (run_test("./capmq -C45 -R test-r.bed test2.sam","6 1 om[-1,46,47,48,50,-1] q[45,42,35,35,45,0]",0,&sam_content_test)) fail++; else pass++;
+
+    // a contig cap below the default
+    if (run_test("./capmq -C46 -t beta:30 test2.sam","6 1 om[-1,-1,47,48,50,-1] q[45,46,46,46,30,0]",0,&sam_content_test)) fail++; else pass++;
+
+    // --scan writes only the report, with counts per contig
+    if (run_test("./capmq -C40 --scan test2.sam","\"beta\": {\"reads\": 1, \"mapped\": 1, \"capped\": 1, \"restored\": 0}",0,&content_contains_test)) fail++; else pass++;
+
+    // a failed manifest job is reported and the rest still run
+    if (run_test("printf 'nosuch.sam\\tt_capmq.tmp.1.sam\\ntest2.sam\\tt_capmq.tmp.2.sam\\n' > t_capmq.tmp.tsv && ./capmq -C40 --manifest t_capmq.tmp.tsv --jobs 2 2>/dev/null; s=$?; cat t_capmq.tmp.2.sam; rm -f t_capmq.tmp.tsv t_capmq.tmp.*.sam; exit $s","r3\t0\tbeta\t5\t40\t",1,&content_contains_test)) fail++; else pass++;
+
+    // a run cut short by a truncated input carries on from its last checkpoint
+    if (run_test("awk '/^@/{print;next}{l[n++]=$0}END{for(i=0;i<20000;i++)for(j=0;j<n;j++)print l[j]}' test2.sam | ./capmq -C100 -O bam - > t_capmq.tmp.in.bam && head -c 60000 t_capmq.tmp.in.bam > t_capmq.tmp.cut.bam; ./capmq -C40 --checkpoint t_capmq.tmp.ckpt --checkpoint-reads 1000 t_capmq.tmp.cut.bam t_capmq.tmp.1.bam 2>/dev/null; ./capmq -C40 --checkpoint t_capmq.tmp.ckpt --resume t_capmq.tmp.in.bam t_capmq.tmp.1.bam && ./capmq -C40 t_capmq.tmp.in.bam t_capmq.tmp.2.bam && ./capmq -C100 t_capmq.tmp.1.bam | grep -v '^@' > t_capmq.tmp.1.sam && ./capmq -C100 t_capmq.tmp.2.bam | grep -v '^@' > t_capmq.tmp.2.sam && cmp t_capmq.tmp.1.sam t_capmq.tmp.2.sam && test ! -e t_capmq.tmp.ckpt && echo resumed; s=$?; rm -f t_capmq.tmp.*; exit $s","resumed",0,&content_contains_test)) fail++; else pass++;
+
+    // MQ is capped at the mate's cap, here a region the read itself is not in
+    if (run_test("./capmq -C100 -O bam test-mq.sam | ./capmq -C45 -R test-r.bed --cap-mq -O bam - | ./capmq -C100 - | grep -o 'MQ:i:[0-9]*' | tr '\\n' ','","MQ:i:35,MQ:i:35,MQ:i:45,MQ:i:42,",0,&content_contains_test)) fail++; else pass++;
+
+    // the reference cache is filled from a FASTA file, matching sequences by their M5 tags
+    if (run_test("printf '>chrT\\nacgt\\nacgt\\n' > t_capmq.tmp.fa && printf '@SQ\\tSN:chrT\\tLN:8\\tM5:cc0af3a4fedb18378b4b57b98068e69f\\nr1\\t0\\tchrT\\t1\\t50\\t4M\\t*\\t0\\t0\\tACGT\\t*\\n' | ./capmq -C40 --ref-cache t_capmq.tmp.cache --ref-seqs t_capmq.tmp.fa - > /dev/null && cat t_capmq.tmp.cache/cc/0a/f3a4fedb18378b4b57b98068e69f; s=$?; rm -rf t_capmq.tmp.fa* t_capmq.tmp.cache; exit $s","ACGTACGT",0,&content_contains_test)) fail++; else pass++;
+
+    // SAM text is parsed and formatted on the pipeline workers, batches splitting the pairs
+    if (run_test("./capmq -C45 -R test-r.bed --cap-mq --pipeline --batch-size 3 -@2 test-mq.sam | awk '!/^@/{printf \"%s,\", $5; for (i=12; i<=NF; i++) if ($i ~ /^MQ:/) printf \"%s,\", $i}'","45,MQ:i:35,42,MQ:i:35,35,MQ:i:45,35,MQ:i:42,45,0,",0,&content_contains_test)) fail++; else pass++;
+
+    // restoring BAM in place closes the gap left by an om tag, last or not
+    if (run_test("printf '@SQ\\tSN:chr1\\tLN:1000\\nr1\\t0\\tchr1\\t1\\t20\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tom:i:50\\tXX:Z:y\\nr2\\t0\\tchr1\\t2\\t20\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tXX:Z:y\\tom:i:45\\nr3\\t0\\tchr1\\t3\\t20\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tXX:Z:z\\n' | ./capmq -C100 -O bam - | ./capmq -r -O bam - | ./capmq -C100 - | grep -v '^@' | cut -f 1,5,12- | tr '\\t\\n' ' ,'","r1 50 XX:Z:y,r2 45 XX:Z:y,r3 20 XX:Z:z,",0,&content_contains_test)) fail++; else pass++;
+
+    // --progress leaves a last report of the whole run
+    if (run_test("./capmq -C40 --progress t_capmq.tmp.progress test1.sam > /dev/null && cat t_capmq.tmp.progress; s=$?; rm -f t_capmq.tmp.progress; exit $s","\"reads\": 6, \"written\": 6, \"capped\": 4, \"restored\": 0",0,&content_contains_test)) fail++; else pass++;
+
+    // -G caps several read groups, the last line for a read group wins, and a name too long for the cursor is still looked up
+    if (run_test("L=$(printf '%0130d' 0 | tr 0 x); printf 'a\\t40\\nb\\t41\\na\\t42\\n%s\\t30\\n' $L > t_capmq.tmp.g && { printf '@SQ\\tSN:c1\\tLN:100\\n'; for rg in a $L $L b a c $L; do printf 'r\\t0\\tc1\\t1\\t50\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:%s\\n' $rg; done; } | ./capmq -S -G t_capmq.tmp.g - | grep -v '^@' | cut -f 5 | tr '\\n' ','; s=$?; rm -f t_capmq.tmp.g; exit $s","42,30,30,41,42,50,30,",0,&content_contains_test)) fail++; else pass++;
+
+    // the read group, contig and store kernel finds RG and an existing om in one pass, on both the bam1_t and the raw BAM paths
+    if (run_test("printf '@SQ\\tSN:c1\\tLN:100\\nr1\\t0\\tc1\\t1\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tom:i:50\\tRG:Z:a\\nr2\\t0\\tc1\\t2\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:b\\tom:i:51\\nr3\\t0\\tc1\\t3\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:a\\nr4\\t0\\tc1\\t4\\t25\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:c\\n' | ./capmq -C30 -g a:20 -t c1:25 - | grep -v '^@' | cut -f 1,5,12- | tr '\\t\\n' ' ,'","r1 20 om:i:50 RG:Z:a,r2 25 RG:Z:b om:i:51,r3 20 RG:Z:a om:i:45,r4 25 RG:Z:c,",0,&content_contains_test)) fail++; else pass++;
+    if (run_test("printf '@SQ\\tSN:c1\\tLN:100\\nr1\\t0\\tc1\\t1\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tom:i:50\\tRG:Z:a\\nr2\\t0\\tc1\\t2\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:b\\tom:i:51\\nr3\\t0\\tc1\\t3\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:a\\nr4\\t0\\tc1\\t4\\t25\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tRG:Z:c\\n' | ./capmq -C100 -O bam - | ./capmq -C30 -g a:20 -t c1:25 -O bam - | ./capmq -C100 - | grep -v '^@' | cut -f 1,5,12- | tr '\\t\\n' ' ,'","r1 20 om:i:50 RG:Z:a,r2 25 RG:Z:b om:i:51,r3 20 RG:Z:a om:i:45,r4 25 RG:Z:c,",0,&content_contains_test)) fail++; else pass++;
+
+    // a CRAM scan decodes the mate fields when capping MQ, and so counts the reads with only MQ capped
+    if (run_test("./capmq -C100 -O cram,no_ref test-mq.sam > t_capmq.tmp.cram && ./capmq -C45 -R test-r.bed --cap-mq --scan --progress t_capmq.tmp.progress t_capmq.tmp.cram > /dev/null && cat t_capmq.tmp.progress; s=$?; rm -f t_capmq.tmp.cram t_capmq.tmp.progress; exit $s","\"reads\": 6, \"written\": 0, \"capped\": 5, \"restored\": 0",0,&content_contains_test)) fail++; else pass++;
+
+    // a manifest job with no caps of its own, and none on the command line, has nothing to do
+    if (run_test("printf 'a\\t40\\n' > t_capmq.tmp.g && printf 'test1.sam\\tt_capmq.tmp.1.sam\\tt_capmq.tmp.g\\ntest2.sam\\tt_capmq.tmp.2.sam\\n' > t_capmq.tmp.manifest && ./capmq --manifest t_capmq.tmp.manifest 2>&1; s=$?; rm -f t_capmq.tmp.g t_capmq.tmp.manifest t_capmq.tmp.1.sam t_capmq.tmp.2.sam; exit $s","t_capmq.tmp.manifest line 2: nothing to do",1,&content_contains_test)) fail++; else pass++;
+
+    // CRAM to CRAM keeps the MD and NM tags the input stores, and adds none
+    if (run_test("printf '@SQ\\tSN:c1\\tLN:100\\nr1\\t0\\tc1\\t1\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\tMD:Z:0G3\\tNM:i:1\\nr2\\t0\\tc1\\t2\\t45\\t4M\\t*\\t0\\t0\\tACGT\\t*\\n' | ./capmq -C100 -O cram,no_ref - > t_capmq.tmp.cram && ./capmq -C30 -O cram,no_ref t_capmq.tmp.cram | ./capmq -C100 - | grep -v '^@' | cut -f 1,5,12- | tr '\\t\\n' ' ,'; s=$?; rm -f t_capmq.tmp.cram; exit $s","r1 30 MD:Z:0G3 NM:i:1 om:i:45,r2 30 om:i:45,",0,&content_contains_test)) fail++; else pass++;
+
+    // contig and region caps have htslib parse the header, which must not lose its text to the @PG line
+    if (run_test("./capmq -C40 -t alpha:30 --split-rg t_capmq.tmp.%r.sam test2.sam > /dev/null && { grep '^@' t_capmq.tmp.b.sam | cut -f1; grep -v '^@' t_capmq.tmp.b.sam | cut -f1,5; } | tr '\\t\\n' ':,'; s=$?; rm -f t_capmq.tmp.*.sam; exit $s","@HD,@SQ,@SQ,@RG,@PG,r2:30,r2:30,r4:0,",0,&content_contains_test)) fail++; else pass++;
+    if (run_test("./capmq -C100 -O bam --write-index test2.sam t_capmq.tmp.bam && ./capmq --by-region --region-size 50 -@2 -C40 -R test-r.bed t_capmq.tmp.bam | grep -v '^@' | cut -f5 | tr '\\n' ','; s=$?; rm -f t_capmq.tmp.bam*; exit $s","40,40,35,35,40,0,",0,&content_contains_test)) fail++; else pass++;
+
+    // each read group's SAM file has a full header of its own, and so reads back, after region caps parse the header
+    if (run_test("./capmq -C40 -R test-r.bed --split-rg t_capmq.tmp.%r.sam test2.sam > /dev/null && ./capmq -C100 t_capmq.tmp.a.sam | awk '/^@/{printf \"%s,\", $1 (/^@RG/ ? $2 : \"\"); next} {printf \"%s:%s,\", $1, $5}'; s=$?; rm -f t_capmq.tmp.*.sam; exit $s","@HD,@SQ,@SQ,@RGID:a,@PG,@PG,r1:40,r1:35,r3:40,",0,&content_contains_test)) fail++; else pass++;
+
+    // --by-region reads the sort order before the @PG line is added, and turns down input not sorted by coordinate
+    if (run_test("./capmq -C100 -O bam test1.sam > t_capmq.tmp.bam && ./capmq --by-region -t alpha:30 t_capmq.tmp.bam 2>&1 > /dev/null; s=$?; rm -f t_capmq.tmp.bam; exit $s","needs coordinate sorted input",1,&content_contains_test)) fail++; else pass++;
+
+    // the last BGZF block is only written as the output is closed, and a failure there is an error (skipped without /dev/full)
+    if (run_test("if [ -w /dev/full ]; then ./capmq -C40 -O bam test1.sam 2>&1 > /dev/full; else echo 'Failed to close'; exit 1; fi","Failed to close",1,&content_contains_test)) fail++; else pass++;
+
+    // --cap-mq keeps the old MQ in mq, so restoring gives back the original reads on every engine
+    if (run_test("./capmq -C100 -S -O bam test-mq.sam > t_capmq.tmp.bam && grep -v '^@' test-mq.sam > t_capmq.tmp.orig && for e in '' '--pipeline -@2' '--block-passthrough' '--no-raw'; do ./capmq -C45 -R test-r.bed --cap-mq $e -O bam t_capmq.tmp.bam | ./capmq -r $e -O bam - > t_capmq.tmp.2.bam && ./capmq -C100 -S t_capmq.tmp.2.bam | grep -v '^@' | cmp -s - t_capmq.tmp.orig && printf 'same,' || printf 'differ,'; done; s=$?; rm -f t_capmq.tmp.bam t_capmq.tmp.2.bam t_capmq.tmp.orig; exit $s","same,same,same,same,",0,&content_contains_test)) fail++; else pass++;
+    // restoring takes out om and mq wherever they are, and leaves an mq the MQ tag cannot hold
+    if (run_test("printf '@SQ\\tSN:c1\\tLN:100\\nr1\\t67\\tc1\\t1\\t40\\t4M\\t=\\t10\\t13\\tACGT\\t*\\tmq:i:47\\tMQ:i:35\\tom:i:46\\tRG:Z:a\\nr2\\t67\\tc1\\t10\\t40\\t4M\\t=\\t1\\t-13\\tACGT\\t*\\tom:i:45\\tMQ:i:35\\tXX:Z:foo\\tmq:i:300\\n' | ./capmq -C100 -S -O bam - > t_capmq.tmp.bam && for e in '' '--block-passthrough' '--no-raw'; do ./capmq -r $e -O bam t_capmq.tmp.bam | ./capmq -C100 -S - | grep -v '^@' | cut -f 1,5,12- | tr '\\t\\n' ' ,'; done; s=$?; rm -f t_capmq.tmp.bam; exit $s","r1 46 MQ:i:47 RG:Z:a,r2 45 MQ:i:35 XX:Z:foo mq:i:300,r1 46 MQ:i:47 RG:Z:a,r2 45 MQ:i:35 XX:Z:foo mq:i:300,r1 46 MQ:i:47 RG:Z:a,r2 45 MQ:i:35 XX:Z:foo mq:i:300,",0,&content_contains_test)) fail++; else pass++;
+
+    // every kernel gives the same reads on the serial, pipeline and raw engines
+    if (run_test("run() { n=0; for e in '--no-raw' '--pipeline -@2 --batch-size 2' ''; do n=$((n+1)); ./capmq $2 $e -O bam $1 | ./capmq -C100 -S - | grep -v '^@' > t_capmq.tmp.out$n; done; cmp -s t_capmq.tmp.out1 t_capmq.tmp.out2 && cmp -s t_capmq.tmp.out1 t_capmq.tmp.out3 && printf 'same,' || printf 'differ,'; }; ./capmq -C100 -S -O bam test-mq.sam > t_capmq.tmp.bam && for o in '-C40 -g a:30' '-C45 -t alpha:42 -S' '-C45 -R test-r.bed --cap-mq' '-C40 -g b:20 -t beta:30 -R test-r.bed --cap-mq -S' '-C30 -g a:20 --cap-mq'; do run t_capmq.tmp.bam \"$o\"; done; ./capmq -C40 -g b:20 --cap-mq -O bam t_capmq.tmp.bam > t_capmq.tmp.c.bam && run t_capmq.tmp.c.bam -r; s=$?; rm -f t_capmq.tmp.bam t_capmq.tmp.c.bam t_capmq.tmp.out*; exit $s","same,same,same,same,same,same,",0,&content_contains_test)) fail++; else pass++;
+
+    // a second @PG line follows on from the first with a new ID
+    if (run_test("./capmq -C40 test1.sam | ./capmq -C30 - | grep '^@PG'","ID:capmq.1\tPN:capmq\tPP:capmq\t",0,&content_contains_test)) fail++; else pass++;
+
     // this should do nothing and say so
     if (run_test("./capmq test1.sam 2>&1","Nothing to do",1,&content_contains_test)) fail++; else pass++;
 
@@ -0,0 +1,127 @@
+/* The MIT License
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+ * Tests of the libcapmq calls themselves, on reads parsed from SAM text.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+#include "capmq.h"
+
+static const char *header =
+    "@SQ\tSN:c1\tLN:1000\n"
+    "@RG\tID:a\n";
+
+static bam1_t *read_from_sam(bam_hdr_t *h, const char *line)
+{
+    kstring_t s = {0, 0, NULL};
+    bam1_t *b = bam_init1();
+
+    kputs(line, &s);
+    if (!b || sam_parse1(&s, h, b) < 0) {
+        fprintf(stderr, "Can't parse read: %s\n", line);
+        exit(1);
+    }
+    free(s.s);
+    return b;
+}
+
+static int aux_int(bam1_t *b, const char *tag)
+{
+    uint8_t *s = bam_aux_get(b, tag);
+    return s ? bam_aux2i(s) : -1;
+}
+
+static int check(const char *what, int got, int expected)
+{
+    if (got == expected) return 0;
+    fprintf(stderr, "%s: expected %d, got %d\n", what, expected, got);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int pass=0, fail=0, i;
+    bam_hdr_t *h = sam_hdr_parse(strlen(header), header);
+    bam1_t *b[3];
+    capmq_rules_t *r;
+
+    if (!h) {
+        fprintf(stderr, "Can't parse header\n");
+        return 1;
+    }
+    b[0] = read_from_sam(h, "r1\t99\tc1\t1\t45\t4M\t=\t100\t103\tACGT\t*\tRG:Z:a\tMQ:i:47");
+    b[1] = read_from_sam(h, "r2\t0\tc1\t10\t30\t4M\t*\t0\t0\tACGT\t*\tRG:Z:a");
+    b[2] = read_from_sam(h, "r3\t0\tc1\t20\t50\t4M\t*\t0\t0\tACGT\t*\tRG:Z:a");
+
+    // rules must be prepared before use
+    r = capmq_rules_init();
+    capmq_set_cap(r, 40);
+    capmq_set_cap_mq(r, true);
+    if (check("apply, unprepared", capmq_apply(r, b[0]), -1)) fail++; else pass++;
+    if (check("apply_n, unprepared", capmq_apply_n(r, b, 3), -1)) fail++; else pass++;
+    if (check("MAPQ left alone, unprepared", b[0]->core.qual, 45)) fail++; else pass++;
+
+    // the read and its MQ are capped, and the old MAPQ kept in om
+    if (check("prepare", capmq_rules_prepare(r, h), 0)) fail++; else pass++;
+    if (check("apply", capmq_apply(r, b[0]), CAPMQ_CAPPED | CAPMQ_MQ_CAPPED)) fail++; else pass++;
+    if (check("capped MAPQ", b[0]->core.qual, 40)) fail++; else pass++;
+    if (check("capped MQ", aux_int(b[0], "MQ"), 40)) fail++; else pass++;
+    if (check("om", aux_int(b[0], "om"), 45)) fail++; else pass++;
+    if (check("mq", aux_int(b[0], "mq"), 47)) fail++; else pass++;
+
+    // a read already under the cap is left alone
+    if (check("apply, under the cap", capmq_apply(r, b[1]), 0)) fail++; else pass++;
+    if (check("uncapped MAPQ", b[1]->core.qual, 30)) fail++; else pass++;
+
+    // of the three, only the one not yet capped changes again
+    if (check("apply_n", capmq_apply_n(r, b, 3), 1)) fail++; else pass++;
+    if (check("capped MAPQ, apply_n", b[2]->core.qual, 40)) fail++; else pass++;
+    capmq_rules_destroy(r);
+
+    // restoring puts back MAPQ from om and MQ from mq, and drops the tags
+    r = capmq_rules_init();
+    capmq_set_restore(r, true);
+    if (check("prepare, restore", capmq_rules_prepare(r, h), 0)) fail++; else pass++;
+    if (check("apply, restore", capmq_apply(r, b[0]), CAPMQ_RESTORED)) fail++; else pass++;
+    if (check("restored MAPQ", b[0]->core.qual, 45)) fail++; else pass++;
+    if (check("om removed", aux_int(b[0], "om"), -1)) fail++; else pass++;
+    if (check("restored MQ", aux_int(b[0], "MQ"), 47)) fail++; else pass++;
+    if (check("mq removed", aux_int(b[0], "mq"), -1)) fail++; else pass++;
+    if (check("apply_n, restore", capmq_apply_n(r, b, 3), 1)) fail++; else pass++;
+    if (check("restored MAPQ, apply_n", b[2]->core.qual, 50)) fail++; else pass++;
+    capmq_rules_destroy(r);
+
+    for (i = 0; i < 3; i++) bam_destroy1(b[i]);
+    bam_hdr_destroy(h);
+
+    printf("Passed %d tests\n", pass);
+    if (fail) printf("FAILED %d tests\n", fail);
+
+    return fail;
+}